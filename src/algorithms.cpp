@@ -2,35 +2,336 @@
 #include <algorithm>
 #include "algorithms.hpp"
 #include "io.hpp"
+#include "trace.hpp"
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <chrono>
+#include <climits>
+#include <atomic>
 
-tuple<Policy, double, vector<double>> value_iteration(OfflineMDP &mdp, int max_steps, float eps) {
+#define PI_TOLERANCE 1e-9
+#define ESTIMATE_ROUND_BATCHES 8
+#define ESTIMATE_CONFIDENCE_Z 1.96
+#define PERFORMANCE_TEST_BLOCKS_PER_THREAD 16
+#define ANDERSON_MEMORY 5
+#define ANDERSON_REGULARIZATION 1e-10
+
+void EpisodeHistory::push_back(int start, Policy &policy, SolverDiagnostics run) {
+    episodes.push_back({start, policies.intern(policy)});
+    diagnostics.push_back(run);
+}
+
+pair<int, int> &EpisodeHistory::operator[](int k) {
+    return episodes[k];
+}
+
+Policy &EpisodeHistory::getPolicy(int k) {
+    return policies.get(episodes[k].second);
+}
+
+int EpisodeHistory::size() {
+    return episodes.size();
+}
+
+template<typename T>
+BasicWorkspace<T>::BasicWorkspace(BasicMDP<T> &mdp) :
+    states(mdp.getStates()),
+    pairs(mdp.getPairs().size()),
+    v(states),
+    w(states),
+    best_action(states),
+    eliminated(pairs),
+    extended_mdp(estimated_rewards, reward_uncertainty, estimated_transition_chances, transition_chance_uncertainty) {}
+
+template<typename T>
+void BasicWorkspace<T>::prepareElimination() {
+    /* Sizes the buffers of action elimination on its first run, later calls keep them */
+    q_values.resize(pairs);
+    minorant.resize(states);
+    minorant_pairs.resize(states);
+}
+
+template<typename T>
+void BasicWorkspace<T>::prepareExtended() {
+    /* Sizes the buffers of EVI on its first run, later calls keep them */
+    if ((int) order.size() == states)
+        return;
+
+    extended_pairs.resize(pairs);
+    order.resize(states);
+    rank.resize(states);
+    uniform.resize(states);
+    for (int y=0; y<states; y++)
+        uniform[y] = {y, 1.0/states};
+
+    // Inner maxima never hold more than one entry per state
+    optimized.reserve(states);
+    bottom.reserve(states);
+}
+
+template<typename T>
+void BasicWorkspace<T>::prepareAnderson() {
+    /* Sizes the buffers of accelerated solvers on their first run, later calls keep them */
+    if ((int) anderson_policy.size() == states)
+        return;
+
+    anderson_df.assign(ANDERSON_MEMORY, vector<double>(states));
+    anderson_dg.assign(ANDERSON_MEMORY, vector<double>(states));
+    anderson_f.resize(states);
+    anderson_g.resize(states);
+    anderson_system.assign(ANDERSON_MEMORY, vector<double>(ANDERSON_MEMORY+1));
+    anderson_gamma.resize(ANDERSON_MEMORY);
+    anderson_policy.resize(states);
+}
+
+template<typename T>
+void BasicWorkspace<T>::clearCounts() {
+    /* Resets learner counts, sizing them on the first call and keeping the capacity of sparse counts later on */
+    visits_before_episode.resize(pairs);
+    visits_during_episode.resize(pairs);
+    observed_rewards_before_episode.resize(pairs);
+    observed_rewards_during_episode.resize(pairs);
+    observed_transitions_before_episode.resize(pairs);
+    observed_transitions_during_episode.resize(pairs);
+    fill(visits_before_episode.begin(), visits_before_episode.end(), 0);
+    fill(visits_during_episode.begin(), visits_during_episode.end(), 0);
+    fill(observed_rewards_before_episode.begin(), observed_rewards_before_episode.end(), 0);
+    fill(observed_rewards_during_episode.begin(), observed_rewards_during_episode.end(), 0);
+    for (int k=0; k<pairs; k++) {
+        observed_transitions_before_episode[k].clear();
+        observed_transitions_during_episode[k].clear();
+    }
+}
+
+template<typename T>
+void check_workspace(BasicMDP<T> &mdp, BasicWorkspace<T> &workspace) {
+    if (workspace.states != mdp.getStates() || workspace.pairs < mdp.getPairs().size())
+        throw invalid_argument("Workspace does not fit the MDP");
+}
+
+template<typename T>
+tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps) {
+    long skipped_backups;
+    return value_iteration(mdp, max_steps, eps, false, skipped_backups);
+}
+
+template<typename T, typename LowerBounds>
+double doeblin_mass(int pairs, LowerBounds lower_bounds, BasicWorkspace<T> &workspace) {
+    /**
+     * Returns beta = sum_y min_k p_k(y) over the pairs 0 to pairs-1, where lower_bounds(k, add) calls add(y, b) for every state y
+     * that pair k reaches with chance at least b > 0, at most once per y
+     * Every pair moves to y with chance at least min_k p_k(y), so the Bellman operator contracts spans by a factor 1-beta
+     */
+
+    vector<double> &minorant = workspace.minorant;
+    vector<int> &minorant_pairs = workspace.minorant_pairs;
+    fill(minorant.begin(), minorant.end(), INFINITY);
+    fill(minorant_pairs.begin(), minorant_pairs.end(), 0);
+    for (int k=0; k<pairs; k++)
+        lower_bounds(k, [&](int y, double b) {
+            minorant[y] = min(minorant[y], b);
+            minorant_pairs[y]++;
+        });
+
+    // A state missed by some pair has minimum 0
+    double beta = 0.0;
+    for (int y=0; y<workspace.states; y++)
+        if (minorant_pairs[y] == pairs)
+            beta += minorant[y];
+    return beta;
+}
+
+void eliminate_actions(int first, int last, vector<double> &q_values, vector<bool> &eliminated, double bias_error) {
+    /**
+     * Action elimination for the pairs first to last-1 of one state, after a sweep q = r + P v where sp(v - h*) <= bias_error
+     * Then q(k) - Q*(k) = P_k (v - h*) lies in an interval of width bias_error for every pair k, so q(k) + bias_error < q(j)
+     * implies Q*(k) < Q*(j), and pair k is suboptimal
+     * Suboptimal pairs are permanently eliminated: the optimal bias and gain still solve the Bellman equation without them
+     */
+
+    double best = -INFINITY;
+    for (int k=first; k<last; k++)
+        if (!eliminated[k])
+            best = max(best, q_values[k]);
+
+    for (int k=first; k<last; k++)
+        if (!eliminated[k] && q_values[k] + bias_error < best)
+            eliminated[k] = true;
+}
+
+template<typename T>
+void anderson_step(vector<double> &v, vector<double> &w, int &points, BasicWorkspace<T> &workspace) {
+    /**
+     * Anderson acceleration of relative value iteration, over the last ANDERSON_MEMORY iterates since the last restart
+     * Given values v and their Bellman image w, normalizes the image to g = w - w[0] and replaces v by the combination of
+     * the last images g whose residuals w - v combine to the lowest norm (least squares through the normal equations)
+     * points counts the iterates seen since the last restart, 0 restarts from a plain step
+     */
+
+    int n = v.size();
+    Matrix<double> &df = workspace.anderson_df;
+    Matrix<double> &dg = workspace.anderson_dg;
+    vector<double> &f = workspace.anderson_f;
+    vector<double> &g = workspace.anderson_g;
+    Matrix<double> &system = workspace.anderson_system;
+    vector<double> &gamma = workspace.anderson_gamma;
+
+    // Residuals are centered, since constant offsets do not count in spans
+    double mean = 0.0;
+    for (int x=0; x<n; x++)
+        mean += w[x] - v[x];
+    mean /= n;
+
+    // Push the differences with the previous iterate in the ring buffer
+    int slot = (points + ANDERSON_MEMORY - 1) % ANDERSON_MEMORY;
+    double w0 = w[0];
+    for (int x=0; x<n; x++) {
+        double gx = w[x] - w0;
+        double fx = w[x] - v[x] - mean;
+        if (points>0) {
+            df[slot][x] = fx - f[x];
+            dg[slot][x] = gx - g[x];
+        }
+        f[x] = fx;
+        g[x] = gx;
+    }
+    points++;
+    int m = min(points-1, ANDERSON_MEMORY);
+
+    // Normal equations df^T df gamma = df^T f, regularized relatively to their scale
+    double trace = 0.0;
+    for (int i=0; i<m; i++) {
+        for (int j=0; j<=i; j++) {
+            double s = 0.0;
+            for (int x=0; x<n; x++)
+                s += df[i][x] * df[j][x];
+            system[i][j] = s;
+            system[j][i] = s;
+        }
+        double s = 0.0;
+        for (int x=0; x<n; x++)
+            s += df[i][x] * f[x];
+        system[i][m] = s;
+        trace += system[i][i];
+    }
+    if (trace==0.0)
+        m = 0;
+    for (int i=0; i<m; i++)
+        system[i][i] += ANDERSON_REGULARIZATION * trace;
+
+    // Gaussian elimination with partial pivoting
+    for (int i=0; i<m; i++) {
+        int pivot = i;
+        for (int j=i+1; j<m; j++)
+            if (abs(system[j][i]) > abs(system[pivot][i]))
+                pivot = j;
+        swap(system[i], system[pivot]);
+        for (int j=i+1; j<m; j++) {
+            double factor = system[j][i] / system[i][i];
+            for (int k=i; k<=m; k++)
+                system[j][k] -= factor * system[i][k];
+        }
+    }
+    for (int i=m-1; i>=0; i--) {
+        double s = system[i][m];
+        for (int j=i+1; j<m; j++)
+            s -= system[i][j] * gamma[j];
+        gamma[i] = s / system[i][i];
+    }
+
+    for (int x=0; x<n; x++) {
+        double vx = g[x];
+        for (int i=0; i<m; i++)
+            vx -= gamma[i] * dg[i][x];
+        v[x] = vx;
+    }
+}
+
+template<typename T>
+tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps, bool elimination, long &skipped_backups, bool accelerated, SolverDiagnostics *diagnostics) {
+    /* Same as the workspace version on a workspace of its own, copying the run to diagnostics if given */
+    BasicWorkspace<T> workspace(mdp);
+    double g = value_iteration(mdp, max_steps, eps, elimination, skipped_backups, workspace, accelerated);
+    if (diagnostics)
+        *diagnostics = workspace.diagnostics;
+    Policy policy = {{workspace.best_action}};
+    return tuple(policy, g, workspace.v);
+}
+
+template<typename T>
+double value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps, bool elimination, long &skipped_backups, BasicWorkspace<T> &workspace, bool accelerated) {
     /* 
         Runs value iteration on an MDP with n states until the span of the difference gets lower than eps
-        Returns the corresponding policy, the gain and the bias
+        With elimination, actions that are provably suboptimal are no longer evaluated, and skipped_backups counts the (x, a) backups saved
+        Elimination needs every pair to share some chance beta > 0 of reaching the same states, and is disabled otherwise
+        With accelerated, iterates are extrapolated by Anderson acceleration, and an iterate whose span grows is replaced by the plain step it came from
+        Returns the gain, leaving the corresponding policy in workspace.best_action, the bias in workspace.v and the run in workspace.diagnostics
     */
 
     if (eps<=0)
         throw invalid_argument("eps must be a positive value");
+    check_workspace(mdp, workspace);
 
+    TRACE_SPAN(trace, "value_iteration");
     int n = mdp.getStates();
-    int a = mdp.getMaxAction();
 
-    vector<double> v(n, 0.0);
-    vector<double> w(n);
-    vector<int> best_action(n);
+    StateActionIndex &pairs = mdp.getPairs();
+
+    vector<double> &v = workspace.v;
+    vector<double> &w = workspace.w;
+    vector<int> &best_action = workspace.best_action;
+    vector<double> &q_values = workspace.q_values;
+    vector<bool> &eliminated = workspace.eliminated;
+    SparseVector<T> &successors = workspace.successors;
+    fill(v.begin(), v.end(), 0.0);
+    fill(eliminated.begin(), eliminated.end(), false);
+    skipped_backups = 0;
+    if (accelerated) {
+        workspace.prepareAnderson();
+        fill(workspace.anderson_policy.begin(), workspace.anderson_policy.end(), -1);
+    }
+
+    // The Bellman operator contracts spans by 1-beta, so after a sweep sp(v - h*) <= sp(w - v) / beta
+    double beta = 0.0;
+    if (elimination) {
+        workspace.prepareElimination();
+        beta = doeblin_mass(pairs.size(), [&](int k, auto add) {
+            mdp.getSuccessors(pairs.states[k], pairs.actions[k], successors);
+            for (auto [y, p]: successors)
+                if (p > 0)
+                    add(y, p);
+        }, workspace);
+        elimination = beta > 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    int points = 0;
+    int rejected = 0;
+    double accepted_span = INFINITY;
 
     for (int t=0;; t++) {
-        // Compute w out of v (Bellman equation)
+        // Compute w out of v (Bellman equation), over the legal pairs of every state
         for (int x=0; x<n; x++) {
-            vector<int> actions = mdp.getAvailableActions(x);
-            float max_q = -INFINITY;
-            for (int action: actions) {
+            double max_q = -INFINITY;
+            for (int k=pairs.offsets[x]; k<pairs.offsets[x+1]; k++) {
+                if (eliminated[k]) {
+                    skipped_backups++;
+                    continue;
+                }
+
                 // q = Q_{t+1}*(x, a)
-                float q = mdp.getRewards(x, action);
-                for (int y=0; y<n; y++)
-                    q += mdp.getTransitionChance(x, action, y) * v[y];
+                int action = pairs.actions[k];
+                double q = mdp.getRewards(x, action);
+                mdp.getSuccessors(x, action, successors);
+                for (auto [y, p]: successors)
+                    q += p * v[y];
+                if (elimination)
+                    q_values[k] = q;
                 if (q>max_q) {
                     // max_q =          max_{a \in A(x)} Q_{t+1}*(x, a)
                     // best_action[x] = argmax of above
@@ -41,6 +342,391 @@ tuple<Policy, double, vector<double>> value_iteration(OfflineMDP &mdp, int max_s
             w[x] = max_q;
         }
 
+        double max_dv = -INFINITY;
+        double min_dv = INFINITY;
+        for (int x=0; x<n; x++) {
+            double dv = w[x]-v[x];
+            if (dv > max_dv)
+                max_dv = dv;
+            if (dv < min_dv)
+                min_dv = dv;
+        }
+        
+        double span = max_dv-min_dv;
+        if (span<eps || t==max_steps) {
+            double w0 = w[0];
+            for (int x=0; x<n; x++)
+                v[x] = w[x] - w0;
+            workspace.diagnostics = {t+1, span, span>=eps, chrono::duration<double>(chrono::steady_clock::now() - start).count(), rejected};
+            TRACE_ARG(trace, "sweeps", t+1);
+            TRACE_ARG(trace, "span", span);
+            TRACE_ARG(trace, "rejected", rejected);
+            return (max_dv + min_dv)/2;
+        }
+
+        if (accelerated && span > accepted_span) {
+            // Safeguard: restart from the plain step of the last accepted iterate, whose span cannot grow
+            copy(workspace.anderson_g.begin(), workspace.anderson_g.end(), v.begin());
+            points = 0;
+            rejected++;
+            accepted_span = INFINITY;
+            continue;
+        }
+
+        if (elimination)
+            for (int x=0; x<n; x++)
+                eliminate_actions(pairs.offsets[x], pairs.offsets[x+1], q_values, eliminated, span / beta);
+
+        if (accelerated) {
+            // Extrapolating across a change of greedy policy mixes different linear maps, so restart
+            if (!equal(best_action.begin(), best_action.end(), workspace.anderson_policy.begin())) {
+                copy(best_action.begin(), best_action.end(), workspace.anderson_policy.begin());
+                points = 0;
+            }
+            accepted_span = span;
+            anderson_step(v, w, points, workspace);
+        } else {
+            double w0 = w[0];
+            for (int x=0; x<n; x++)
+                v[x] = w[x] - w0;
+        }
+    }
+}
+
+template<typename T>
+vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &mdp, vector<Matrix<T>> &rewards, int max_steps, float eps) {
+    /* Runs batched value iteration with reward matrices, keeping only their nonzero rewards */
+    StateActionIndex &pairs = mdp.getPairs();
+    vector<SparseVector<T>> sparse_rewards(rewards.size());
+    for (int i=0; i<(int) rewards.size(); i++)
+        for (int k=0; k<pairs.size(); k++)
+            if (rewards[i][pairs.states[k]][pairs.actions[k]] != 0)
+                sparse_rewards[i].push_back({k, rewards[i][pairs.states[k]][pairs.actions[k]]});
+    return batched_value_iteration(mdp, sparse_rewards, max_steps, eps);
+}
+
+template<typename T>
+vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &mdp, vector<SparseVector<T>> &rewards, int max_steps, float eps) {
+    /**
+     * Runs value iteration on K MDPs sharing the states, actions and transition kernel of mdp
+     * rewards[i] lists the nonzero rewards of MDP i as (legal pair of mdp, reward), other pairs award 0
+     * Values are stored state-major, v[y*K + j], so every successor of a sweep updates the K Bellman backups at once
+     * Each MDP is dropped from the batch once the span of its difference gets lower than eps, so K shrinks as MDPs converge
+     * Returns the corresponding policy, gain and bias of every MDP
+     */
+
+    if (eps<=0)
+        throw invalid_argument("eps must be a positive value");
+
+    TRACE_SPAN(trace, "batched_value_iteration");
+    int n = mdp.getStates();
+    int count = rewards.size();
+    StateActionIndex &pairs = mdp.getPairs();
+
+    // Rewards by pair: reward_problems[reward_offsets[k]..reward_offsets[k+1]] are the MDPs rewarding pair k
+    vector<int> reward_offsets(pairs.size()+1, 0);
+    for (auto &problem_rewards: rewards) {
+        for (auto [k, r]: problem_rewards) {
+            if (k<0 || k>=pairs.size())
+                throw invalid_argument("rewards must be indexed by legal pairs of mdp");
+            reward_offsets[k+1]++;
+        }
+    }
+    for (int k=0; k<pairs.size(); k++)
+        reward_offsets[k+1] += reward_offsets[k];
+    vector<pair<int, T>> reward_problems(reward_offsets.back());
+    vector<int> filled(reward_offsets.begin(), reward_offsets.end()-1);
+    for (int i=0; i<count; i++)
+        for (auto [k, r]: rewards[i])
+            reward_problems[filled[k]++] = {i, r};
+
+    // column[i] := position of MDP i in the batch, -1 once it converged, problems[j] is its inverse
+    int K = count;
+    vector<int> column(count);
+    vector<int> problems(count);
+    vector<int> kept(count);
+    for (int i=0; i<count; i++)
+        column[i] = problems[i] = i;
+
+    vector<double> v(n*K, 0.0);
+    vector<double> w(n*K);
+    vector<double> q(K);
+    vector<int> best_action(n*K);
+    vector<double> max_dv(K);
+    vector<double> min_dv(K);
+    SparseVector<T> successors;
+
+    Matrix<int> policies(count, vector<int>(n));
+    vector<double> gains(count);
+    Matrix<double> biases(count, vector<double>(n));
+
+    for (int t=0; K>0; t++) {
+        // Compute w out of v (Bellman equation) for all MDPs of the batch
+        for (int x=0; x<n; x++) {
+            double *wx = &w[x*K];
+            int *best = &best_action[x*K];
+            fill(wx, wx+K, -INFINITY);
+            for (int k=pairs.offsets[x]; k<pairs.offsets[x+1]; k++) {
+                int action = pairs.actions[k];
+                fill(q.begin(), q.begin()+K, 0.0);
+                for (int e=reward_offsets[k]; e<reward_offsets[k+1]; e++) {
+                    int j = column[reward_problems[e].first];
+                    if (j>=0)
+                        q[j] += reward_problems[e].second;
+                }
+                mdp.getSuccessors(x, action, successors);
+                for (auto [y, p]: successors) {
+                    double *vy = &v[y*K];
+                    for (int j=0; j<K; j++)
+                        q[j] += p * vy[j];
+                }
+                for (int j=0; j<K; j++) {
+                    if (q[j]>wx[j]) {
+                        wx[j] = q[j];
+                        best[j] = action;
+                    }
+                }
+            }
+        }
+
+        fill(max_dv.begin(), max_dv.begin()+K, -INFINITY);
+        fill(min_dv.begin(), min_dv.begin()+K, INFINITY);
+        for (int x=0; x<n; x++) {
+            for (int j=0; j<K; j++) {
+                double dv = w[x*K+j] - v[x*K+j];
+                max_dv[j] = max(max_dv[j], dv);
+                min_dv[j] = min(min_dv[j], dv);
+            }
+        }
+        for (int x=0; x<n; x++)
+            for (int j=0; j<K; j++)
+                v[x*K+j] = w[x*K+j] - w[j];
+
+        // Save results of MDPs that just converged and drop them from the batch
+        int remaining = 0;
+        for (int j=0; j<K; j++) {
+            int i = problems[j];
+            if (max_dv[j]-min_dv[j]>=eps && t<max_steps) {
+                kept[remaining++] = j;
+                continue;
+            }
+            for (int x=0; x<n; x++) {
+                policies[i][x] = best_action[x*K+j];
+                biases[i][x] = v[x*K+j];
+            }
+            gains[i] = (max_dv[j]+min_dv[j])/2;
+            column[i] = -1;
+        }
+
+        // Compact values of remaining MDPs in place, entries only move to lower indices
+        if (remaining < K) {
+            for (int x=0; x<n; x++)
+                for (int j=0; j<remaining; j++)
+                    v[x*remaining+j] = v[x*K+kept[j]];
+            for (int j=0; j<remaining; j++) {
+                problems[j] = problems[kept[j]];
+                column[problems[j]] = j;
+            }
+            K = remaining;
+        }
+    }
+
+    vector<tuple<Policy, double, vector<double>>> results;
+    for (int i=0; i<count; i++) {
+        Policy policy = {{policies[i]}};
+        results.emplace_back(policy, gains[i], biases[i]);
+    }
+    return results;
+}
+
+vector<double> solve_sparse(vector<map<int, double>> rows, vector<double> b) {
+    /**
+     * Solves the square linear system rows.u = b by Gaussian elimination with partial pivoting
+     * rows[i] maps column indices to the nonzero coefficients of row i
+     * Only nonzero coefficients are stored and updated, so fill-in stays small on chain-like kernels
+     */
+
+    int n = rows.size();
+
+    // rows_with_column[j] := rows that still have a nonzero coefficient in column j
+    vector<set<int>> rows_with_column(n);
+    for (int i=0; i<n; i++)
+        for (auto &[j, c]: rows[i])
+            rows_with_column[j].insert(i);
+
+    vector<int> pivot_row(n);
+    vector<bool> used(n, false);
+    for (int k=0; k<n; k++) {
+        // Pick the largest coefficient in column k among rows that have not been used as pivots
+        int p = -1;
+        double best = 0.0;
+        for (int i: rows_with_column[k]) {
+            if (!used[i] && fabs(rows[i][k]) > best) {
+                best = fabs(rows[i][k]);
+                p = i;
+            }
+        }
+        if (p<0)
+            throw runtime_error("Singular system");
+        used[p] = true;
+        pivot_row[k] = p;
+
+        // Eliminate column k from all other remaining rows
+        vector<int> targets(rows_with_column[k].begin(), rows_with_column[k].end());
+        for (int i: targets) {
+            if (used[i])
+                continue;
+            double f = rows[i][k] / rows[p][k];
+            for (auto &[j, c]: rows[p]) {
+                double d = rows[i][j] - f*c;
+                if (j==k || d==0.0) {
+                    rows[i].erase(j);
+                    rows_with_column[j].erase(i);
+                }
+                else {
+                    rows[i][j] = d;
+                    rows_with_column[j].insert(i);
+                }
+            }
+            b[i] -= f*b[p];
+        }
+    }
+
+    // Back substitution: the pivot row of column k only has coefficients in columns >= k
+    vector<double> u(n);
+    for (int k=n-1; k>=0; k--) {
+        int p = pivot_row[k];
+        double s = b[p];
+        for (auto &[j, c]: rows[p])
+            if (j>k)
+                s -= c*u[j];
+        u[k] = s / rows[p][k];
+    }
+    return u;
+}
+
+template<typename T>
+pair<double, vector<double>> evaluate_policy(BasicOfflineMDP<T> &mdp, vector<int> &pol) {
+    /**
+     * Solves the gain/bias equations g + h(x) = r(x, pol(x)) + sum_y p(y | x, pol(x)) h(y) with h(0) = 0
+     * Unknowns are stored as u = (g, h(1), ..., h(n-1)), h(0) being replaced by g
+     * Returns the gain and the bias
+     */
+
+    int n = mdp.getStates();
+    vector<map<int, double>> rows(n);
+    vector<double> b(n);
+    SparseVector<T> successors;
+
+    for (int x=0; x<n; x++) {
+        // Float rows do not sum exactly to 1, which slowly mixing chains amplify into large bias errors: renormalize in double
+        mdp.getSuccessors(x, pol[x], successors);
+        double total = 0.0;
+        for (auto [y, p]: successors)
+            total += p;
+
+        rows[x][0] = 1.0;
+        if (x>0)
+            rows[x][x] = 1.0;
+        for (auto [y, p]: successors)
+            if (y>0)
+                rows[x][y] -= p / total;
+        b[x] = mdp.getRewards(x, pol[x]);
+    }
+
+    vector<double> u = solve_sparse(rows, b);
+    double g = u[0];
+    vector<double> h = u;
+    h[0] = 0.0;
+    return pair(g, h);
+}
+
+template<typename T>
+tuple<Policy, double, vector<double>> policy_iteration(BasicOfflineMDP<T> &mdp, int max_steps) {
+    /**
+     * Runs policy iteration on an MDP with n states until the policy is stable
+     * Policies are evaluated exactly, which assumes every policy met along the way is unichain
+     * Returns the corresponding policy, the gain and the bias
+     */
+
+    int n = mdp.getStates();
+    SparseVector<T> successors;
+
+    vector<int> pol(n);
+    for (int x=0; x<n; x++)
+        pol[x] = mdp.getAvailableActions(x)[0];
+
+    for (int t=0;; t++) {
+        auto [g, h] = evaluate_policy(mdp, pol);
+
+        // Improve policy, only switching actions that are strictly better to avoid cycling between ties
+        bool stable = true;
+        vector<int> improved = pol;
+        for (int x=0; x<n; x++) {
+            double q_current = mdp.getRewards(x, pol[x]);
+            mdp.getSuccessors(x, pol[x], successors);
+            for (auto [y, p]: successors)
+                q_current += p * h[y];
+
+            double max_q = q_current;
+            for (int action: mdp.getAvailableActions(x)) {
+                double q = mdp.getRewards(x, action);
+                mdp.getSuccessors(x, action, successors);
+                for (auto [y, p]: successors)
+                    q += p * h[y];
+                if (q > max_q + PI_TOLERANCE) {
+                    max_q = q;
+                    improved[x] = action;
+                    stable = false;
+                }
+            }
+        }
+
+        if (stable || t==max_steps) {
+            Policy policy = {{pol}};
+            return tuple(policy, g, h);
+        }
+        pol = improved;
+    }
+}
+
+template<typename T>
+tuple<Policy, double, vector<double>> modified_policy_iteration(BasicOfflineMDP<T> &mdp, int k, int max_steps, float eps) {
+    /**
+     * Runs modified policy iteration on an MDP with n states until the span of the difference gets lower than eps
+     * Every improvement step (one Bellman backup) is followed by k sweeps of partial evaluation of the greedy policy
+     * Returns the corresponding policy, the gain and the bias
+     */
+
+    if (eps<=0)
+        throw invalid_argument("eps must be a positive value");
+    if (k<0)
+        throw invalid_argument("k must be non-negative");
+
+    int n = mdp.getStates();
+    SparseVector<T> successors;
+
+    vector<double> v(n, 0.0);
+    vector<double> w(n);
+    vector<int> best_action(n);
+
+    for (int t=0;; t++) {
+        // Improvement: compute w out of v (Bellman equation) and the greedy policy
+        for (int x=0; x<n; x++) {
+            double max_q = -INFINITY;
+            for (int action: mdp.getAvailableActions(x)) {
+                double q = mdp.getRewards(x, action);
+                mdp.getSuccessors(x, action, successors);
+                for (auto [y, p]: successors)
+                    q += p * v[y];
+                if (q>max_q) {
+                    max_q = q;
+                    best_action[x] = action;
+                }
+            }
+            w[x] = max_q;
+        }
+
         double max_dv = -INFINITY;
         double min_dv = INFINITY;
         for (int x=0; x<n; x++) {
@@ -54,77 +740,199 @@ tuple<Policy, double, vector<double>> value_iteration(OfflineMDP &mdp, int max_s
         double v0 = v[0];
         for (int x=0; x<n; x++)
             v[x] -= v0;
-        
+
         double span = max_dv-min_dv;
         if (span<eps || t==max_steps) {
-            vector<int> pol;
             double g = (max_dv + min_dv)/2;
-            for (int x=0; x<n; x++)
-                pol.push_back(best_action[x]);
-            Policy policy = {{pol}};
+            Policy policy = {{best_action}};
             return tuple(policy, g, v);
         }
+
+        // Partial evaluation: k sweeps of the Bellman operator of the greedy policy
+        for (int i=0; i<k; i++) {
+            for (int x=0; x<n; x++) {
+                int action = best_action[x];
+                double q = mdp.getRewards(x, action);
+                mdp.getSuccessors(x, action, successors);
+                for (auto [y, p]: successors)
+                    q += p * v[y];
+                w[x] = q;
+            }
+            double w0 = w[0];
+            for (int x=0; x<n; x++)
+                v[x] = w[x] - w0;
+        }
     }
 }
 
-vector<float> invariant_measure(OfflineMDP &mdp, Policy &policy) {
+template<typename T>
+vector<float> invariant_measure(BasicOfflineMDP<T> &mdp, Policy &policy) {
     /* Get invariant measure of a policy with value iteration */
     
+    TRACE_SPAN(trace, "invariant_measure");
     int n = mdp.getStates();
-    int a = mdp.getMaxAction();
     vector<float> ans;
-    
-    for (int x=0; x<n; x++) {
-        // Only policy actions are legal
-        Matrix<int> actions;
-        for (int i=0; i<n; i++) 
-            actions.push_back({policy(i, 0)});
-
-        // Every action awards 0 except from state x
-        Matrix<float> rewards(n, vector<float>(a, 0.0));
-        rewards[x][policy(x, 0)] = 1.0;
-        
-        OfflineMDP nmdp = OfflineMDP(actions, mdp.getTransitionKernel(), rewards);
-        double g = get<1>(value_iteration(nmdp, 1e5, 1e-5));
-        ans.push_back(g);
-    }
+    for (int x=0; x<n; x++)
+        if (mdp.getPairs().find(x, policy(x, 0)) < 0)
+            throw invalid_argument("Illegal action");
+
+    // Only policy actions are legal, and successors are read through mdp so that implicit models work as well as stored ones
+    BasicImplicitMDP<T> nmdp(n,
+        [&](int x) {return vector<int>{policy(x, 0)};},
+        [&](int x, int action, SparseVector<T> &successors) {mdp.getSuccessors(x, action, successors);},
+        [](int, int) {return (T) 0;});
+
+    // MDP x awards 0 for every action except from state x, all MDPs are solved in one batch
+    // Every state has a single legal pair in nmdp, so pair x is the one of state x
+    vector<SparseVector<T>> rewards(n);
+    for (int x=0; x<n; x++)
+        rewards[x] = {{x, 1.0}};
+
+    for (auto &result: batched_value_iteration<T>(nmdp, rewards, 1e5, 1e-5))
+        ans.push_back(get<1>(result));
     return ans;
 }
 
-vector<float> invariant_measure_estimate(Agent &agent, int steps) {
+template<typename T>
+vector<float> invariant_measure_estimate(BasicAgent<T> &agent, int steps) {
     /**
      * Get empirical estimate of invariant measure
      * Agent uses its policy on its MDP starting from the MDP's state when calling the function
      * Return value is frequency of visit of every state
      */
     
-    vector<float> frequency(agent.getMDP().getStates(), 0.0);
+    vector<long> visits(agent.getMDP().getStates(), 0);
 
     for (int i=0; i<steps; i++) {
         agent.usePolicy();
-        frequency[agent.getMDP().getState()]++;
+        visits[agent.getMDP().getState()]++;
     }
     
     vector<float> d;
-    for (int f: frequency)
-        d.push_back(((float) f)/steps);
+    for (long f: visits)
+        d.push_back(((double) f)/steps);
     return d;
 }
 
-double gap_regret(int x, int a, OfflineMDP &mdp) {
+template<typename T>
+InvariantMeasureEstimate invariant_measure_estimate(BasicMDP<T> &mdp, Policy &policy, long steps, int batch_size, double target, int chains) {
+    /**
+     * Get empirical estimate of invariant measure from independent chains run in parallel
+     * Every chain uses policy on a copy of mdp with its own random generator, starting from the MDP's state when calling the function
+     * Chains are cut into batches of batch_size steps, and confidence intervals are computed from the batch means of visit frequencies
+     * Runs at most steps steps overall, stopping as soon as every interval is narrower than target if target > 0
+     * chains = 0 uses one chain per core
+     */
+
+    if (batch_size<=0)
+        throw invalid_argument("batch_size must be a positive value");
+    if (chains<=0)
+        chains = max(1u, thread::hardware_concurrency());
+
+    int n = mdp.getStates();
+    long batches = steps / batch_size;
+    if (batches<1)
+        throw invalid_argument("steps must be at least batch_size");
+
+    // Chains are copies of the MDP, seeded independently
+    random_device rd;
+    vector<unique_ptr<BasicMDP<T>>> chain_mdps;
+    for (int c=0; c<chains; c++) {
+        chain_mdps.push_back(mdp.clone());
+        chain_mdps[c]->seed(rd());
+    }
+
+    // Rollouts check the policy when built, so they are built here where exceptions reach the caller, not on worker threads
+    vector<unique_ptr<BasicRollout<T>>> rollouts;
+    for (int c=0; c<chains; c++)
+        rollouts.push_back(make_unique<BasicRollout<T>>(*chain_mdps[c], policy));
+
+    // Per chain: total visits, and sums of batch frequencies and of their squares for every state
+    Matrix<long> visits(chains, vector<long>(n, 0));
+    Matrix<double> sums(chains, vector<double>(n, 0.0));
+    Matrix<double> squares(chains, vector<double>(n, 0.0));
+
+    InvariantMeasureEstimate estimate;
+    long done = 0;
+    while (done < batches) {
+        // Share the remaining batches between chains, only running a few of them per round if there is a target
+        long remaining = batches - done;
+        vector<long> round_batches(chains);
+        for (int c=0; c<chains; c++) {
+            round_batches[c] = remaining / chains + (c < remaining % chains);
+            if (target>0)
+                round_batches[c] = min(round_batches[c], (long) ESTIMATE_ROUND_BATCHES);
+        }
+
+        vector<thread> threads;
+        for (int c=0; c<chains; c++) {
+            threads.emplace_back([&, c]() {
+                BasicRollout<T> &rollout = *rollouts[c];
+                vector<long> batch_visits(n);
+                vector<double> no_rewards;
+                for (long b=0; b<round_batches[c]; b++) {
+                    fill(batch_visits.begin(), batch_visits.end(), 0);
+                    rollout.run(batch_size, batch_visits, no_rewards);
+                    for (int x=0; x<n; x++) {
+                        double f = (double) batch_visits[x] / batch_size;
+                        visits[c][x] += batch_visits[x];
+                        sums[c][x] += f;
+                        squares[c][x] += f*f;
+                    }
+                }
+            });
+        }
+        for (thread &t: threads)
+            t.join();
+        for (int c=0; c<chains; c++)
+            done += round_batches[c];
+
+        // Batch means and their confidence intervals
+        estimate.measure.assign(n, 0.0);
+        estimate.half_width.assign(n, INFINITY);
+        estimate.steps = done * batch_size;
+        double widest = 0.0;
+        for (int x=0; x<n; x++) {
+            double sum = 0.0, square = 0.0;
+            long total = 0;
+            for (int c=0; c<chains; c++) {
+                sum += sums[c][x];
+                square += squares[c][x];
+                total += visits[c][x];
+            }
+            estimate.measure[x] = (double) total / estimate.steps;
+            if (done>1) {
+                double variance = max(0.0, (square - sum*sum/done) / (done-1));
+                estimate.half_width[x] = ESTIMATE_CONFIDENCE_Z * sqrt(variance/done);
+            }
+            widest = max(widest, estimate.half_width[x]);
+        }
+
+        if (target>0 && widest<target)
+            break;
+    }
+
+    return estimate;
+}
+
+template<typename T>
+double gap_regret(int x, int a, BasicOfflineMDP<T> &mdp) {
     auto vi_data = value_iteration(mdp, 1e5, 1e-5);
     double g = get<1>(vi_data);
     vector<double> h = get<2>(vi_data);
     
     double reward_gap = g - mdp.getRewards(x, a);
     double bias_gap = h[x];
-    for (int y=0; y<mdp.getStates(); y++)
-        bias_gap -= mdp.getTransitionChance(x, a, y)*h[y];
+    SparseVector<T> successors;
+    mdp.getSuccessors(x, a, successors);
+    for (auto [y, p]: successors)
+        bias_gap -= p*h[y];
 
     return reward_gap + bias_gap;
 }
 
-double optimize(vector<double> &p, vector<double> &u, double eps) {
+template<typename T>
+double optimize(SparseVector<double> &p, vector<double> &u, double eps, BasicWorkspace<T> &workspace) {
     /**
      * Solves the following optimization problem:
      * Find vector q that maximizes < q | u > under the constraints
@@ -132,116 +940,260 @@ double optimize(vector<double> &p, vector<double> &u, double eps) {
      *  . |q| = 1
      *  . 0 <= q(x) <= 1 for all x
      * Returns < q | u >
+     * p is only given on its support, an empty p standing for the uniform distribution
+     * workspace.order sorts states descendingly according to their u-values, workspace.rank is its inverse
      */
 
-    int n = p.size();
+    int n = u.size();
+    vector<int> &order = workspace.order;
+    vector<int> &rank = workspace.rank;
+
+    // Without observations p is uniform, and a large enough eps moves all weight to the best state
+    if (p.empty()) {
+        if (eps >= 2.0*(1.0 - 1.0/n))
+            return u[order[0]];
+        return optimize(workspace.uniform, u, eps, workspace);
+    }
+
+    // Create q similar to p, only states in the support of p can give weight
+    SparseVector<double> &q = workspace.optimized;
+    q.assign(p.begin(), p.end());
+    int support = q.size();
+    vector<int> &bottom = workspace.bottom;
+    bottom.resize(support);
+    for (int k=0; k<support; k++)
+        bottom[k] = k;
+    sort(bottom.begin(), bottom.end(), [&](int k, int l) {return rank[q[k].first] > rank[q[l].first];});
+
+    // Weight is received from the top of order, either from the support of p or from states out of it
+    auto slot = [&](int y) {
+        for (int k=0; k<(int) q.size(); k++)
+            if (q[k].first == y)
+                return k;
+        q.push_back({y, 0.0});
+        return (int) q.size() - 1;
+    };
 
-    // Sort states descendingly according to their u-values
-    vector<int> s(n);
-    for (int i=0; i<n; i++)
-        s[i] = i;
-    stable_sort(s.begin(), s.end(), [&](int i, int j) {return u[i] > u[j];});
-    
-    // Create q similar to p
-    vector<double> q(n);
-    for (int i=0; i<n; i++)
-        q[s[i]] = p[s[i]];
-    
     // Add as much weight as possible to q_i for i maximizing u_i, taking from q_j for j minimizing u_j
-    int i=0, j=n-1;
-    while (i<j) {
-        double m = min({0.5*eps, 1.0-q[s[i]], q[s[j]]});
+    int i=0, j=0;
+    while (j<support && i<rank[q[bottom[j]].first]) {
+        int si = slot(order[i]);
+        int sj = bottom[j];
+        double m = min({0.5*eps, 1.0-q[si].second, q[sj].second});
+
+        q[si].second += m;
+        q[sj].second -= m;
 
-        q[s[i]] += m;
-        q[s[j]] -= m;
-        
         eps -= 2*m;
         if (m == eps*0.5)
             break;
-        if (m == 1.0-q[s[i]])
+        if (m == 1.0-q[si].second)
             i++;
         else
-            j--;
+            j++;
     }
 
-    for (int i=0; i<n; i++)
-        q[i] = round(q[i]*1e5) / 1e5;
+    double value = 0.0;
+    for (auto [y, q_y]: q)
+        value += round(q_y*1e5) / 1e5 * u[y];
+    return value;
+}
+
+template<typename T>
+tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps) {
+    long skipped_backups;
+    return extended_value_iteration(mdp, extended_mdp, max_steps, eps, false, skipped_backups);
+}
 
-    return inner_product(q.begin(), q.end(), u.begin(), 0.0);
+template<typename T>
+tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps, bool elimination, long &skipped_backups, bool accelerated, SolverDiagnostics *diagnostics) {
+    /* Same as the workspace version on a workspace of its own, copying the run to diagnostics if given */
+    BasicWorkspace<T> workspace(mdp);
+    double g = extended_value_iteration(mdp, extended_mdp, max_steps, eps, elimination, skipped_backups, workspace, accelerated);
+    if (diagnostics)
+        *diagnostics = workspace.diagnostics;
+    Policy policy = {{workspace.best_action}};
+    return tuple(policy, g, workspace.v);
 }
 
-tuple<Policy, double, vector<double>> extended_value_iteration(MDP &mdp, ExtendedMDP &extended_mdp, int max_steps, float eps) {
+template<typename T>
+double extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps, bool elimination, long &skipped_backups, BasicWorkspace<T> &workspace, bool accelerated) {
     /**
      * Runs extended value iteration until span of u-value is below eps and returns corresponding policy
+     * With elimination, actions that are provably suboptimal in the extended MDP are no longer evaluated, and skipped_backups counts the (x, a) backups saved
+     * As in value_iteration, elimination is disabled unless every transition allowed by the estimates shares some chance of reaching the same states
      * Extended MDP has:
      *  - states as in mdp,
      *  - transitions p within ||p[x][a] - estimated_transition_chances[x][a][.]|| < transition_chance_uncertainty[x][a],
      *  - rewards within estimated_rewards +/- reward_uncertainty
      * Computation of inner maximum according to NEAR-OPTIMAL REGRET BOUNDS FOR REINFORCEMENT LEARNING, Jaksch & al
+     * With accelerated, iterates are extrapolated by Anderson acceleration as in value_iteration
+     * Returns the gain, leaving the corresponding policy in workspace.best_action, the bias in workspace.v and the run in workspace.diagnostics
      */
 
+    check_workspace(mdp, workspace);
+
+    TRACE_SPAN(trace, "extended_value_iteration");
     int n = mdp.getStates();
-    int a = mdp.getMaxAction();
 
-    vector<double> v(n, 0.0);
-    vector<double> w(n);
-    vector<int> best_action(n);
+    StateActionIndex &pairs = mdp.getPairs();
+
+    vector<double> &v = workspace.v;
+    vector<double> &w = workspace.w;
+    vector<int> &best_action = workspace.best_action;
+    vector<double> &q_values = workspace.q_values;
+    vector<bool> &eliminated = workspace.eliminated;
+    workspace.prepareExtended();
+    vector<int> &order = workspace.order;
+    vector<int> &rank = workspace.rank;
+    fill(v.begin(), v.end(), 0.0);
+    fill(eliminated.begin(), eliminated.end(), false);
+
+    // Pairs of mdp are looked up in the layout of the estimates, which differs when mdp restricts the actions of the learnt model
+    vector<int> &extended_pairs = workspace.extended_pairs;
+    bool same_layout = (pairs == extended_mdp.pairs);
+    for (int k=0; k<pairs.size(); k++) {
+        extended_pairs[k] = same_layout ? k : extended_mdp.pairs.find(pairs.states[k], pairs.actions[k]);
+        if (extended_pairs[k] < 0)
+            throw invalid_argument("Extended MDP does not estimate every pair of the MDP");
+    }
+    skipped_backups = 0;
+    if (accelerated) {
+        workspace.prepareAnderson();
+        fill(workspace.anderson_policy.begin(), workspace.anderson_policy.end(), -1);
+    }
+
+    // Transitions within L1 distance d of an estimate p move to y with chance at least p(y) - d/2, unvisited pairs are estimated uniform
+    double beta = 0.0;
+    if (elimination) {
+        workspace.prepareElimination();
+        beta = doeblin_mass(pairs.size(), [&](int k, auto add) {
+            int e = extended_pairs[k];
+            double d = extended_mdp.transition_chance_uncertainty[e];
+            SparseVector<double> &estimate = extended_mdp.estimated_transition_chances[e];
+            if (estimate.empty()) {
+                if (1.0/n > d/2)
+                    for (int y=0; y<n; y++)
+                        add(y, 1.0/n - d/2);
+                return;
+            }
+            for (auto [y, p]: estimate)
+                if (p > d/2)
+                    add(y, p - d/2);
+        }, workspace);
+        elimination = beta > 0;
+    }
+
+    auto start = chrono::steady_clock::now();
+    int points = 0;
+    int rejected = 0;
+    double accepted_span = INFINITY;
     
     double g;
     for (int t=0;; t++) {
+        // Sort states descendingly according to their u-values, shared by every inner maximum of the sweep
+        // Ties are broken by state as a stable sort would, without its temporary buffer
+        for (int y=0; y<n; y++)
+            order[y] = y;
+        sort(order.begin(), order.end(), [&](int i, int j) {return v[i] > v[j] || (v[i] == v[j] && i < j);});
+        for (int k=0; k<n; k++)
+            rank[order[k]] = k;
+
         for (int x=0; x<n; x++) {
-            float max_q = -INFINITY;
-            for (int action: mdp.getAvailableActions(x)) {
-                double r_opt = extended_mdp.getOptimistReward(x, action);
-                double p_opt = optimize(extended_mdp.estimated_transition_chances[x][action], v, extended_mdp.transition_chance_uncertainty[x][action]);
+            double max_q = -INFINITY;
+            for (int k=pairs.offsets[x]; k<pairs.offsets[x+1]; k++) {
+                if (eliminated[k]) {
+                    skipped_backups++;
+                    continue;
+                }
+
+                int e = extended_pairs[k];
+                double r_opt = extended_mdp.getOptimistReward(e);
+                double p_opt = optimize(extended_mdp.estimated_transition_chances[e], v, extended_mdp.transition_chance_uncertainty[e], workspace);
                 double q = r_opt + p_opt;
+                if (elimination)
+                    q_values[k] = q;
                 
                 if (q>max_q) {
                     // max_q =          max_{a \in A(x)} Q_{t+1}*(x, a)
                     // best_action[x] = argmax of above
                     max_q = q;
-                    best_action[x] = action;
+                    best_action[x] = pairs.actions[k];
                 };
             }
             w[x] = max_q;
         }
         
-        float max_dv = -INFINITY;
-        float min_dv = INFINITY;
+        double max_dv = -INFINITY;
+        double min_dv = INFINITY;
         for (int x=0; x<n; x++) {
-            float dv = w[x]-v[x];
+            double dv = w[x]-v[x];
             if (dv > max_dv)
                 max_dv = dv;
             if (dv < min_dv)
                 min_dv = dv;
-            v[x] = w[x];
         }
-
-        float v0 = v[0];
-        for (int x=0; x<n; x++)
-            v[x] -= v0;
         
-        float span = max_dv - min_dv;
+        double span = max_dv - min_dv;
         if (span < eps || t > max_steps) {
+            double v0 = w[0];
+            for (int x=0; x<n; x++)
+                v[x] = w[x] - v0;
             g = (max_dv + min_dv) / 2;
+            workspace.diagnostics = {t+1, span, span>=eps, chrono::duration<double>(chrono::steady_clock::now() - start).count(), rejected};
+            TRACE_ARG(trace, "sweeps", t+1);
+            TRACE_ARG(trace, "span", span);
+            TRACE_ARG(trace, "rejected", rejected);
             break;
         }
+
+        if (accelerated && span > accepted_span) {
+            // Safeguard: restart from the plain step of the last accepted iterate
+            copy(workspace.anderson_g.begin(), workspace.anderson_g.end(), v.begin());
+            points = 0;
+            rejected++;
+            accepted_span = INFINITY;
+            continue;
+        }
+
+        if (elimination)
+            for (int x=0; x<n; x++)
+                eliminate_actions(pairs.offsets[x], pairs.offsets[x+1], q_values, eliminated, span / beta);
+
+        if (accelerated) {
+            // Extrapolating across a change of greedy policy mixes different linear maps, so restart
+            if (!equal(best_action.begin(), best_action.end(), workspace.anderson_policy.begin())) {
+                copy(best_action.begin(), best_action.end(), workspace.anderson_policy.begin());
+                points = 0;
+            }
+            accepted_span = span;
+            anderson_step(v, w, points, workspace);
+        } else {
+            double v0 = w[0];
+            for (int x=0; x<n; x++)
+                v[x] = w[x] - v0;
+        }
     }
 
-    vector<int> pol;
-    for (int x=0; x<n; x++)
-        pol.push_back(best_action[x]);
-    Policy policy = {{pol}};
+    return g;
+}
 
-    return tuple(policy, g, v);
+template<typename T>
+pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &mdp, float delta, int steps, int episodes, const History &context, bool accelerated) {
+    BasicWorkspace<T> workspace(mdp);
+    return ucrl2(mdp, delta, steps, episodes, context, workspace, accelerated);
 }
 
-pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episodes, const History &context) {
+template<typename T>
+pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &mdp, float delta, int steps, int episodes, const History &context, BasicWorkspace<T> &workspace, bool accelerated) {
     /*
         Plays UCRL2 on MDP mdp for a given duration, given the previous history provided by context
+        Counts, estimates and EVI buffers are taken from workspace
+        With accelerated, episodes are planned by Anderson-accelerated EVI instead of plain EVI
         Returns observed history and vector of episode start times
     */
     
+    check_workspace(mdp, workspace);
     int t = context.size() + 1;
     double total_rewards;
 
@@ -249,21 +1201,20 @@ pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episod
     EpisodeHistory episode_history;
 
     int states = mdp.getStates();
-    int actions = mdp.getMaxAction();
     int state = mdp.getState();
     
-    Matrix<int> visits_before_episode(states, vector<int>(actions, 0));
-    Matrix<int> visits_during_episode(states, vector<int>(actions, 0));
-    Matrix<float> observed_rewards_before_episode(states, vector<float>(actions, 0.0));
-    Matrix<float> observed_rewards_during_episode(states, vector<float>(actions, 0.0));
-    Matrix3D<int> observed_transitions_before_episode(states, Matrix<int>(actions, vector<int>(states, 0)));
-    Matrix3D<int> observed_transitions_during_episode(states, Matrix<int>(actions, vector<int>(states, 0)));
-
-    Matrix<double> estimated_rewards(states, vector<double>(actions, 0.0));
-    Matrix<double> reward_uncertainty(states, vector<double>(actions, 0.0));
-    Matrix3D<double> estimated_transition_chances(states, Matrix<double>(actions, vector<double>(states, 0)));
-    Matrix<double> transition_chance_uncertainty(states, vector<double>(actions, 0.0));
-    ExtendedMDP extended_mdp(estimated_rewards, reward_uncertainty, estimated_transition_chances, transition_chance_uncertainty);
+    workspace.clearCounts();
+    // Counts are indexed by legal pairs
+    StateActionIndex &pairs = mdp.getPairs();
+    vector<int> &visits_before_episode = workspace.visits_before_episode;
+    vector<int> &visits_during_episode = workspace.visits_during_episode;
+    vector<T> &observed_rewards_before_episode = workspace.observed_rewards_before_episode;
+    vector<T> &observed_rewards_during_episode = workspace.observed_rewards_during_episode;
+    vector<SparseVector<int>> &observed_transitions_before_episode = workspace.observed_transitions_before_episode;
+    vector<SparseVector<int>> &observed_transitions_during_episode = workspace.observed_transitions_during_episode;
+    BasicExtendedMDP<T> &extended_mdp = workspace.extended_mdp;
+    vector<long> episode_visits(states), episode_limits(states);
+    vector<double> episode_rewards;
 
     // Read previous history
     int x=state, y=state, a;
@@ -274,9 +1225,10 @@ pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episod
         y = get<2>(e);
         r = get<3>(e);
 
-        visits_during_episode[x][a]++;
-        observed_rewards_during_episode[x][a] += r;
-        observed_transitions_during_episode[x][a][y]++;
+        int k = pairs.find(x, a);
+        visits_during_episode[k]++;
+        observed_rewards_during_episode[k] += r;
+        sparse_increment(observed_transitions_during_episode[k], y);
     }
     state = y;
 
@@ -285,55 +1237,54 @@ pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episod
     while (true) {
         k++;
         int start = t;
+        TRACE_SPAN(trace, "episode");
+        TRACE_ARG(trace, "episode", k);
 
         // Initialize state-action counts, accumulated rewards and transition counts for the current episode
-        for (int x=0; x<states; x++) {
-            for (int a: mdp.getAvailableActions(x)) {
-                visits_before_episode[x][a] += visits_during_episode[x][a];
-                visits_during_episode[x][a] = 0;
-                observed_rewards_before_episode[x][a] += observed_rewards_during_episode[x][a];
-                observed_rewards_during_episode[x][a] = 0.0;
-
-                for (int y=0; y<states; y++) {
-                    observed_transitions_before_episode[x][a][y] += observed_transitions_during_episode[x][a][y];
-                    observed_transitions_during_episode[x][a][y] = 0.0;
-                }
+        {
+            TRACE_SPAN(fold_trace, "fold counts");
+            for (int k=0; k<pairs.size(); k++) {
+                visits_before_episode[k] += visits_during_episode[k];
+                visits_during_episode[k] = 0;
+                observed_rewards_before_episode[k] += observed_rewards_during_episode[k];
+                observed_rewards_during_episode[k] = 0.0;
+                sparse_merge(observed_transitions_before_episode[k], observed_transitions_during_episode[k]);
             }
         }
         extended_mdp.update(mdp, visits_before_episode, observed_rewards_before_episode, observed_transitions_before_episode, start, delta);
 
         // Compute optimal policy for optimist MDP (EVI)
-        auto evi_output = extended_value_iteration(mdp, extended_mdp, 1000, 1.0/sqrt(start));
-        Policy policy = get<0>(evi_output);
-        Agent agent = Agent(mdp, policy);
-        episode_history.push_back(pair(start, policy));
+        long skipped_backups;
+        extended_value_iteration(mdp, extended_mdp, 1000, 1.0/sqrt(start), false, skipped_backups, workspace, accelerated);
+        Policy policy = {{workspace.best_action}};
+        BasicRollout<T> rollout(mdp, policy);
+        episode_history.push_back(start, policy, workspace.diagnostics);
+        TRACE_ARG(trace, "evi sweeps", workspace.diagnostics.sweeps);
 
         // Iterate episode until a state-action pair has been visited in the current episode as many times as all episodes prior
-        while (visits_during_episode[state][policy(state, 0)] < max(1, visits_before_episode[state][policy(state, 0)])) {
-            float rewards;
-            agent.usePolicy(rewards);
-            
-            int x = state;
-            int a = policy(x, 0);
-            int y = mdp.getState();
-
-            visits_during_episode[x][a]++;
-            observed_transitions_during_episode[x][a][y]++;
-            observed_rewards_during_episode[x][a] += rewards;
-            total_rewards += rewards;
-            
-            Event event(x, a, y, rewards);
-            history.push_back(event);
-
-            t++;
-            if (steps>0)
-                show_loading_bar("Running UCRL2...   ", t, steps);
-            state = y;
+        // The whole episode is played by the rollout engine, which stops in the first state whose action reached its limit
+        TRACE_SPAN(simulation_trace, "simulation");
+        for (int x=0; x<states; x++) {
+            episode_visits[x] = 0;
+            episode_limits[x] = max(1, visits_before_episode[pairs.find(x, policy(x, 0))]);
+        }
+        int logged = history.size();
+        t += rollout.runUntil(steps > t ? steps - t : LONG_MAX, episode_visits, episode_limits, episode_rewards, &history);
 
-            if (t==steps)
-                break;
+        // Fold the episode into the counts of the current episode
+        for (int i=logged; i<(int) history.size(); i++) {
+            auto [x, a, y, rewards] = history[i];
+            int k = pairs.find(x, a);
+            visits_during_episode[k]++;
+            sparse_increment(observed_transitions_during_episode[k], y);
+            observed_rewards_during_episode[k] += rewards;
+            total_rewards += rewards;
         }
+        state = mdp.getState();
+        if (steps>0)
+            show_loading_bar("Running UCRL2...   ", t, steps);
 
+        TRACE_ARG(simulation_trace, "steps", t-start);
         if (t==steps || k==episodes)
             break;
     }
@@ -341,13 +1292,6 @@ pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episod
     return pair(history, episode_history);
 }
 
-bool compare_policies(Policy &a, Policy &b, int states) {
-    for (int x=0; x<states; x++)
-        if (a(x, 0) != b(x, 0))
-            return false;
-    return true;
-}
-
 int find_bad_episode(History &history, EpisodeHistory &episode_history, Policy &opt_policy, int min) {
     /** Finds index of a bad episode late enough in a UCRL2 run, 0 if no such episode can be found
       * . history: plays the recorded UCRL2 run
@@ -356,25 +1300,32 @@ int find_bad_episode(History &history, EpisodeHistory &episode_history, Policy &
       * . min: the minimum starting time of the returned episode
       */
     
-    int k=-1;
-    for (auto episode: episode_history) {
-        k++;
-        int start_time = episode.first;
-        Policy policy = episode.second;
+    // Policies are interned, so an episode uses the optimal policy iff it has its ID (-1 if it was never used)
+    int opt_id = episode_history.policies.find(opt_policy);
+
+    for (int k=0; k<episode_history.size(); k++) {
+        auto [start_time, id] = episode_history[k];
 
         if (start_time<min)
             continue;
         
-        if (compare_policies(policy, opt_policy, policy.v.size()))
+        if (id == opt_id)
             continue;
         
-        show_policy(policy);
+        show_policy(episode_history.getPolicy(k));
         return k;
     }
     return 0;
 }
 
-pair<vector<double>, vector<double>> performance_test(OfflineMDP &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta) {
+template<typename T>
+pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta, int threads) {
+    BasicWorkspace<T> workspace(mdp);
+    return performance_test(mdp, policy, past, history, start, duration, delta, workspace, threads);
+}
+
+template<typename T>
+pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta, BasicWorkspace<T> &workspace, int threads) {
     /** Compares optimistic gain under the given policy throughout the provided history, and optimistic value without the policy restraint
       * . mdp: the MDP to run EVI on
       * . policy: the policy that is being evaluated
@@ -382,67 +1333,131 @@ pair<vector<double>, vector<double>> performance_test(OfflineMDP &mdp, Policy &p
       * . history: the history of UCRL2 plays of the episode to evaluate
       * . start: when the episode started
       * . delta: the parameter for computing confidence intervals
+      * . workspace: buffers for counts, estimates and EVI
+      * . threads: number of threads solving steps in parallel, 0 for one per core
+      * Both solves of a step only depend on the counts at that step, so steps are cut into blocks handed out in order to the threads
+      * Every thread rolls its own counts forward to the start of its next block, so gains are the same as with a single thread
+      * With several threads, all threads but one use their own buffers, and workspace is left with the counts of an arbitrary step
       */
 
+    check_workspace(mdp, workspace);
+    TRACE_SPAN(trace, "performance_test");
     int n = mdp.getStates();
-    int actions = mdp.getMaxAction();
-
-    Matrix<double> estimated_rewards(n, vector<double>(actions, 0.0));
-    Matrix<double> reward_uncertainty(n, vector<double>(actions, 0.0));
-    Matrix3D<double> estimated_transition_chances(n, Matrix<double>(actions, vector<double>(n, 0)));
-    Matrix<double> transition_chance_uncertainty(n, vector<double>(actions, 0.0));
-    ExtendedMDP extended_mdp(estimated_rewards, reward_uncertainty, estimated_transition_chances, transition_chance_uncertainty);
-
-    Matrix<int> visits(n, vector<int>(actions, 0));
-    Matrix<float> observed_rewards(n, vector<float>(actions, 0.0));
-    Matrix3D<int> observed_transitions(n, Matrix<int>(actions, vector<int>(n, 0)));
+    if (threads<=0)
+        threads = max(1u, thread::hardware_concurrency());
 
-    Matrix<int> policy_actions(n);
-    for (int x=0; x<n; x++)
-        policy_actions[x] = {policy(x, 0)};
-    MDP mdp_with_policy_actions(policy_actions, mdp.getTransitionKernel(), mdp.getRewardMatrix());
+    Matrix<int> policy_actions(n, vector<int>(1));
+    for (int x=0; x<n; x++) {
+        policy_actions[x][0] = policy(x, 0);
+        if (mdp.getPairs().find(x, policy(x, 0)) < 0)
+            throw invalid_argument("Illegal action");
+    }
+    // EVI plans on the estimates and only reads the actions of this model, so the empty kernel of an implicit model is never indexed
+    BasicMDP<T> mdp_with_policy_actions(policy_actions, mdp.getTransitionKernel(), mdp.getRewardMatrix());
 
+    int steps = min(duration, (int) history.size());
     vector<double> g_opt(duration);
     vector<double> g(duration);
 
-    int x, a, y;
-    double r;
+    // A single thread plays all steps as one block, several threads share blocks handed out in order
+    int block_size = threads == 1 ? max(1, steps) : max(1, steps / (threads * PERFORMANCE_TEST_BLOCKS_PER_THREAD));
+    int blocks = (steps + block_size - 1) / block_size;
+    atomic<int> next_block(0);
 
-    for (Event e: past) {
-        x = get<0>(e);
-        a = get<1>(e);
-        y = get<2>(e);
-        r = get<3>(e);
+    auto solve_blocks = [&](BasicWorkspace<T> &thread_workspace) {
+        thread_workspace.clearCounts();
+        BasicExtendedMDP<T> &extended_mdp = thread_workspace.extended_mdp;
+        vector<int> &visits = thread_workspace.visits_before_episode;
+        vector<T> &observed_rewards = thread_workspace.observed_rewards_before_episode;
+        vector<SparseVector<int>> &observed_transitions = thread_workspace.observed_transitions_before_episode;
 
-        visits[x][a]++;
-        observed_rewards[x][a] += r;
-        observed_transitions[x][a][y]++;
-    }
+        auto count = [&](Event &e) {
+            auto [x, a, y, r] = e;
+            int k = mdp.getPairs().find(x, a);
+            if (k < 0)
+                throw invalid_argument("History has an illegal action");
+            visits[k]++;
+            observed_rewards[k] += r;
+            sparse_increment(observed_transitions[k], y);
+        };
 
-    int t=start;
-    for (Event e: history) {
-        if (t >= start+duration)
-            break;
+        for (Event &e: past)
+            count(e);
 
-        x = get<0>(e);
-        a = get<1>(e);
-        y = get<2>(e);
-        r = get<3>(e);
-
-        visits[x][a]++;
-        observed_rewards[x][a] += r;
-        observed_transitions[x][a][y]++;
-
-        extended_mdp.update(mdp, visits, observed_rewards, observed_transitions, t, delta);
+        // Events of history counted so far
+        int counted = 0;
+        for (int b = next_block++; b < blocks; b = next_block++) {
+            int first = b * block_size;
+            int last = min(steps, first + block_size);
+            while (counted < first)
+                count(history[counted++]);
 
-        auto evi_output_opt = extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5);
-        g_opt[t-start] = get<1>(evi_output_opt);
+            for (int i=first; i<last; i++) {
+                count(history[counted++]);
+                int t = start + i;
+                extended_mdp.update(mdp, visits, observed_rewards, observed_transitions, t, delta);
 
-        auto evi_output = extended_value_iteration(mdp_with_policy_actions, extended_mdp, 1e3, 1e-5);
-        g[t-start] = get<1>(evi_output);
+                long skipped_backups;
+                g_opt[i] = extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5, false, skipped_backups, thread_workspace);
+                g[i] = extended_value_iteration(mdp_with_policy_actions, extended_mdp, 1e3, 1e-5, false, skipped_backups, thread_workspace);
+            }
+        }
+    };
 
-        t++;
+    if (threads == 1) {
+        solve_blocks(workspace);
+        return pair(g, g_opt);
     }
 
+    // An exception leaving a thread would terminate the program, so the first one is kept and rethrown once all threads joined
+    vector<unique_ptr<BasicWorkspace<T>>> thread_workspaces;
+    for (int i=1; i<threads; i++)
+        thread_workspaces.push_back(make_unique<BasicWorkspace<T>>(mdp));
+    exception_ptr error;
+    mutex error_mutex;
+    auto solve_blocks_safely = [&](BasicWorkspace<T> &thread_workspace) {
+        try {
+            solve_blocks(thread_workspace);
+        } catch (...) {
+            lock_guard<mutex> lock(error_mutex);
+            if (!error)
+                error = current_exception();
+            next_block = blocks;
+        }
+    };
+    vector<thread> pool;
+    for (int i=1; i<threads; i++)
+        pool.emplace_back(solve_blocks_safely, ref(*thread_workspaces[i-1]));
+    solve_blocks_safely(workspace);
+    for (thread &worker: pool)
+        worker.join();
+    if (error)
+        rethrow_exception(error);
+
     return pair(g, g_opt);
-}
\ No newline at end of file
+}
+
+// Explicit instantiations for single and double precision models
+#define INSTANTIATE_ALGORITHMS(T) \
+    template struct BasicWorkspace<T>; \
+    template tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &, int, float); \
+    template tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &, int, float, bool, long &, bool, SolverDiagnostics *); \
+    template double value_iteration(BasicOfflineMDP<T> &, int, float, bool, long &, BasicWorkspace<T> &, bool); \
+    template vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &, vector<Matrix<T>> &, int, float); \
+    template vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &, vector<SparseVector<T>> &, int, float); \
+    template tuple<Policy, double, vector<double>> policy_iteration(BasicOfflineMDP<T> &, int); \
+    template tuple<Policy, double, vector<double>> modified_policy_iteration(BasicOfflineMDP<T> &, int, int, float); \
+    template vector<float> invariant_measure(BasicOfflineMDP<T> &, Policy &); \
+    template vector<float> invariant_measure_estimate(BasicAgent<T> &, int); \
+    template InvariantMeasureEstimate invariant_measure_estimate(BasicMDP<T> &, Policy &, long, int, double, int); \
+    template double gap_regret(int, int, BasicOfflineMDP<T> &); \
+    template tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &, BasicExtendedMDP<T> &, int, float); \
+    template tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &, BasicExtendedMDP<T> &, int, float, bool, long &, bool, SolverDiagnostics *); \
+    template double extended_value_iteration(BasicMDP<T> &, BasicExtendedMDP<T> &, int, float, bool, long &, BasicWorkspace<T> &, bool); \
+    template pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &, float, int, int, const History &, bool); \
+    template pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &, float, int, int, const History &, BasicWorkspace<T> &, bool); \
+    template pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &, Policy &, History &, History &, int, int, double, int); \
+    template pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &, Policy &, History &, History &, int, int, double, BasicWorkspace<T> &, int);
+
+INSTANTIATE_ALGORITHMS(float)
+INSTANTIATE_ALGORITHMS(double)
@@ -1,13 +1,113 @@
+#include <tuple>
 #include "mdp.hpp"
 
-using Event = tuple<int, int, int, double>;
-using History = vector<Event>;
-using EpisodeHistory = vector<pair<int, Policy>>;
+struct SolverDiagnostics {
+    int sweeps;                     // Bellman sweeps run, including those of rejected accelerated steps
+    double span;                    // Span of the last value difference, bounding the error on the gain
+    bool hit_cap;                   // Whether max_steps ran out before the span got lower than eps
+    double seconds;                 // Wall-clock time of the run
+    int rejected;                   // Accelerated steps rejected by the safeguard
+};
 
-tuple<Policy, double, vector<double>> value_iteration(OfflineMDP &mdp, int max_steps, float eps);
-vector<float> invariant_measure(OfflineMDP &mdp, Policy &policy);
-vector<float> invariant_measure_estimate(Agent &agent, int steps);
-double gap_regret(int x, int a, OfflineMDP &mdp);
-pair<History, EpisodeHistory> ucrl2(MDP &mdp, float delta, int steps, int episodes = 0, const History &context = History(0));
+struct EpisodeHistory {
+    /**
+     *  Episodes of a UCRL2 run, as (start time, policy ID) pairs
+     *  Policies are interned in a store, so consecutive episodes reusing a policy share its copy
+     *  The run of the solver that planned every episode is kept alongside
+     */
+    PolicyStore policies;
+    vector<pair<int, int>> episodes;
+    vector<SolverDiagnostics> diagnostics;
+
+    void push_back(int start, Policy &policy, SolverDiagnostics run = {});
+    pair<int, int> &operator[](int k);
+    Policy &getPolicy(int k);
+    int size();
+};
+
+template<typename T>
+struct BasicWorkspace {
+    /**
+     *  Buffers of solvers and learners for an MDP, reused across calls on it or on models with fewer legal pairs
+     *  Only the buffers of plain solvers are allocated upfront: elimination, EVI, accelerated and learner buffers are sized by their first use,
+     *  so that solving a large model does not pay for learning it
+     *  Tables of state-action pairs are indexed by the legal pairs of the model (see StateActionIndex)
+     *  Chances and observed rewards have the scalar type T of the model, UCRL2 estimates, values and gains are always double
+     *  Solvers running on a workspace leave the policy they found in best_action and the bias in v
+     *  A workspace serves one call at a time, and cannot be copied since extended_mdp refers to its own buffers
+     */
+    int states;
+    int pairs;
+
+    // Solvers
+    vector<double> v;
+    vector<double> w;
+    vector<int> best_action;
+    vector<double> q_values;
+    vector<bool> eliminated;
+    vector<double> minorant;            // minorant[y] := lowest chance of reaching y over the pairs counted in minorant_pairs[y], for elimination
+    vector<int> minorant_pairs;
+    vector<int> extended_pairs;         // extended_pairs[k] := pair of the extended MDP estimating pair k of the solved model
+    SparseVector<T> successors;
+    vector<int> order;                  // States sorted by decreasing value, for EVI inner maxima
+    vector<int> rank;
+    SparseVector<double> optimized;     // Distribution maximizing an EVI inner maximum
+    vector<int> bottom;
+    SparseVector<double> uniform;
+    Matrix<double> anderson_df;         // Last differences of residuals, for accelerated solvers
+    Matrix<double> anderson_dg;         // Last differences of normalized Bellman images
+    vector<double> anderson_f;
+    vector<double> anderson_g;
+    Matrix<double> anderson_system;
+    vector<double> anderson_gamma;
+    vector<int> anderson_policy;        // Greedy policy of the last accelerated step
+    SolverDiagnostics diagnostics;      // Filled by the last solver run on the workspace
+
+    // Learners
+    vector<int> visits_before_episode;
+    vector<int> visits_during_episode;
+    vector<T> observed_rewards_before_episode;
+    vector<T> observed_rewards_during_episode;
+    vector<SparseVector<int>> observed_transitions_before_episode;
+    vector<SparseVector<int>> observed_transitions_during_episode;
+    vector<double> estimated_rewards;
+    vector<double> reward_uncertainty;
+    vector<SparseVector<double>> estimated_transition_chances;
+    vector<double> transition_chance_uncertainty;
+    BasicExtendedMDP<T> extended_mdp;
+
+    BasicWorkspace(BasicMDP<T> &mdp);
+    BasicWorkspace(const BasicWorkspace &) = delete;
+    void prepareElimination();
+    void prepareExtended();
+    void prepareAnderson();
+    void clearCounts();
+};
+
+using Workspace = BasicWorkspace<float>;
+
+struct InvariantMeasureEstimate {
+    vector<double> measure;         // Frequency of visit of every state
+    vector<double> half_width;      // Half-width of 95% confidence intervals from batch means
+    long steps;                     // Steps run over all chains
+};
+
+template<typename T> tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps);
+template<typename T> tuple<Policy, double, vector<double>> value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps, bool elimination, long &skipped_backups, bool accelerated = false, SolverDiagnostics *diagnostics = nullptr);
+template<typename T> double value_iteration(BasicOfflineMDP<T> &mdp, int max_steps, float eps, bool elimination, long &skipped_backups, BasicWorkspace<T> &workspace, bool accelerated = false);
+template<typename T> vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &mdp, vector<Matrix<T>> &rewards, int max_steps, float eps);
+template<typename T> vector<tuple<Policy, double, vector<double>>> batched_value_iteration(BasicOfflineMDP<T> &mdp, vector<SparseVector<T>> &rewards, int max_steps, float eps);
+template<typename T> tuple<Policy, double, vector<double>> policy_iteration(BasicOfflineMDP<T> &mdp, int max_steps);
+template<typename T> tuple<Policy, double, vector<double>> modified_policy_iteration(BasicOfflineMDP<T> &mdp, int k, int max_steps, float eps);
+template<typename T> vector<float> invariant_measure(BasicOfflineMDP<T> &mdp, Policy &policy);
+template<typename T> vector<float> invariant_measure_estimate(BasicAgent<T> &agent, int steps);
+template<typename T> InvariantMeasureEstimate invariant_measure_estimate(BasicMDP<T> &mdp, Policy &policy, long steps, int batch_size, double target = 0.0, int chains = 0);
+template<typename T> double gap_regret(int x, int a, BasicOfflineMDP<T> &mdp);
+template<typename T> tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps);
+template<typename T> tuple<Policy, double, vector<double>> extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps, bool elimination, long &skipped_backups, bool accelerated = false, SolverDiagnostics *diagnostics = nullptr);
+template<typename T> double extended_value_iteration(BasicMDP<T> &mdp, BasicExtendedMDP<T> &extended_mdp, int max_steps, float eps, bool elimination, long &skipped_backups, BasicWorkspace<T> &workspace, bool accelerated = false);
+template<typename T> pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &mdp, float delta, int steps, int episodes = 0, const History &context = History(0), bool accelerated = false);
+template<typename T> pair<History, EpisodeHistory> ucrl2(BasicMDP<T> &mdp, float delta, int steps, int episodes, const History &context, BasicWorkspace<T> &workspace, bool accelerated = false);
 int find_bad_episode(History &history, EpisodeHistory &episode_history, Policy &opt_policy, int min);
-pair<vector<double>, vector<double>> performance_test(OfflineMDP &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta);
\ No newline at end of file
+template<typename T> pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta, int threads = 1);
+template<typename T> pair<vector<double>, vector<double>> performance_test(BasicOfflineMDP<T> &mdp, Policy &policy, History &past, History &history, int start, int duration, double delta, BasicWorkspace<T> &workspace, int threads = 1);
\ No newline at end of file
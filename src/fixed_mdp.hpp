@@ -0,0 +1,249 @@
+#ifndef FIXED_MDP_HEADER
+#define FIXED_MDP_HEADER
+
+#include <array>
+#include <random>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+template<typename T, int S, int A>
+using FixedKernel = array<array<array<T, S>, A>, S>;
+
+template<typename T, int S, int A>
+using FixedTable = array<array<T, A>, S>;
+
+template<int S>
+using FixedPolicy = array<int, S>;
+
+template<int S, int A, typename T = float>
+struct FixedMDP {
+    /**
+     *  Markov decision process whose numbers of states S and actions A are known at compile time
+     *  Every action is available from every state, and all tables are stored inline in std::array, so that
+     *  simulation, value iteration and extended value iteration loops have constant bounds and get unrolled
+     *  Rewards are Bernoulli, as in MDP
+     */
+
+    using Policy = FixedPolicy<S>;
+    using Values = array<double, S>;
+
+    FixedKernel<T, S, A> transitions;   // transitions[x][a][y] := p(y | x, a)
+    FixedTable<T, S, A> rewards;        // R(x, a) ~ B(rewards[x][a])
+};
+
+template<int S, int A, typename T = float>
+class FixedSimulator {
+    /**
+     *  Simulator of a FixedMDP, drawing successors out of cumulative chances tabulated once
+     */
+
+    private:
+    FixedKernel<T, S, A> cumulative;    // cumulative[x][a][y] := p(0..y | x, a)
+    FixedTable<T, S, A> rewards;
+    int state;
+    mt19937 gen;
+    uniform_real_distribution<T> uniform;
+
+    public:
+    FixedSimulator(const FixedMDP<S, A, T> &mdp, int state = 0) : rewards(mdp.rewards), state(state), gen(random_device()()), uniform(0, 1) {
+        for (int x=0; x<S; x++) {
+            for (int a=0; a<A; a++) {
+                T sum = 0;
+                for (int y=0; y<S; y++) {
+                    sum += mdp.transitions[x][a][y];
+                    cumulative[x][a][y] = sum;
+                }
+            }
+        }
+    }
+
+    void seed(unsigned int seed) {
+        gen.seed(seed);
+    }
+
+    int getState() {
+        return state;
+    }
+
+    T makeAction(int action) {
+        /* Plays action from the current state and returns the reward, the next state is the number of cumulative chances below u */
+        auto &chances = cumulative[state][action];
+        T u = uniform(gen);
+        int next_state = 0;
+        for (int y=0; y<S-1; y++)
+            next_state += (u >= chances[y]);
+        T reward = (uniform(gen) <= rewards[state][action]) ? 1 : 0;
+        state = next_state;
+        return reward;
+    }
+
+    double rollout(const FixedPolicy<S> &policy, long steps) {
+        /* Plays a stationary policy for a given number of steps, returns the total rewards */
+        double total_rewards = 0.0;
+        for (long t=0; t<steps; t++)
+            total_rewards += makeAction(policy[state]);
+        return total_rewards;
+    }
+};
+
+template<int S, int A, typename T = float>
+struct FixedExtendedMDP {
+    /**
+     *  Optimistic MDP built by UCRL2 out of observed counts, as ExtendedMDP for a FixedMDP
+     *  Estimated chances are dense, unvisited pairs holding the uniform estimate
+     *  Estimates are double whatever the scalar type T of observed rewards, as in ExtendedMDP
+     */
+
+    using Policy = FixedPolicy<S>;
+    using Values = array<double, S>;
+
+    FixedTable<double, S, A> estimated_rewards;
+    FixedTable<double, S, A> reward_uncertainty;
+    FixedKernel<double, S, A> estimated_transition_chances;
+    FixedTable<double, S, A> transition_chance_uncertainty;
+
+    void update(const FixedTable<int, S, A> &visits, const FixedTable<T, S, A> &observed_rewards, const FixedKernel<int, S, A> &observed_transitions, int t, double delta) {
+        for (int x=0; x<S; x++) {
+            for (int a=0; a<A; a++) {
+                int n = max(1, visits[x][a]);
+                estimated_rewards[x][a] = observed_rewards[x][a] / n;
+                for (int y=0; y<S; y++)
+                    estimated_transition_chances[x][a][y] = visits[x][a] > 0 ? (double) observed_transitions[x][a][y] / n : 1.0 / S;
+                reward_uncertainty[x][a] = sqrt(3.5 * log(2*S*A*t/delta) / n);
+                transition_chance_uncertainty[x][a] = sqrt(14 * log(2*A*t/delta) / n);
+            }
+        }
+    }
+};
+
+template<int S, int A, typename T>
+double fixed_value_iteration(const FixedMDP<S, A, T> &mdp, int max_steps, double eps, typename FixedMDP<S, A, T>::Policy &policy, typename FixedMDP<S, A, T>::Values &bias) {
+    /**
+     * Runs value iteration on a FixedMDP until the span of the difference gets lower than eps
+     * Returns the gain, leaving the corresponding policy in policy and the bias in bias
+     */
+
+    array<double, S> &v = bias;
+    array<double, S> w;
+    v.fill(0.0);
+
+    for (int t=0;; t++) {
+        for (int x=0; x<S; x++) {
+            double max_q = -INFINITY;
+            for (int a=0; a<A; a++) {
+                double q = mdp.rewards[x][a];
+                for (int y=0; y<S; y++)
+                    q += mdp.transitions[x][a][y] * v[y];
+                if (q > max_q) {
+                    max_q = q;
+                    policy[x] = a;
+                }
+            }
+            w[x] = max_q;
+        }
+
+        double max_dv = -INFINITY;
+        double min_dv = INFINITY;
+        for (int x=0; x<S; x++) {
+            max_dv = max(max_dv, w[x]-v[x]);
+            min_dv = min(min_dv, w[x]-v[x]);
+        }
+        for (int x=0; x<S; x++)
+            v[x] = w[x] - w[0];
+
+        if (max_dv-min_dv < eps || t == max_steps)
+            return (max_dv + min_dv)/2;
+    }
+}
+
+template<int S>
+double fixed_optimize(const array<double, S> &p, const array<double, S> &u, double eps, const FixedPolicy<S> &order) {
+    /**
+     * Inner maximum of EVI on dense chances: maximizes < q | u > over distributions q with |p-q| < eps (1-norm)
+     * Same operator as optimize, including its stopping rules and the rounding of q to 1e-5, so that both EVIs agree:
+     * weight goes to the best states from order[0] on, and is taken from the worst states of the support of p first
+     */
+
+    // Enough weight to move everything to the best state, as optimize does for unvisited pairs
+    if (eps >= 2.0*(1.0 - p[order[0]]))
+        return u[order[0]];
+
+    // bottom[j] := position in order of the j-th worst state of the support of p
+    array<double, S> q = p;
+    array<int, S> bottom;
+    int support = 0;
+    for (int k=S-1; k>=0; k--)
+        if (p[order[k]] > 0)
+            bottom[support++] = k;
+
+    int i=0, j=0;
+    while (j<support && i<bottom[j]) {
+        int si = order[i];
+        int sj = order[bottom[j]];
+        double m = min({0.5*eps, 1.0-q[si], q[sj]});
+
+        q[si] += m;
+        q[sj] -= m;
+
+        eps -= 2*m;
+        if (m == eps*0.5)
+            break;
+        if (m == 1.0-q[si])
+            i++;
+        else
+            j++;
+    }
+
+    double value = 0.0;
+    for (int y=0; y<S; y++)
+        value += round(q[y]*1e5) / 1e5 * u[y];
+    return value;
+}
+
+template<int S, int A, typename T>
+double fixed_extended_value_iteration(const FixedExtendedMDP<S, A, T> &extended_mdp, int max_steps, double eps, typename FixedExtendedMDP<S, A, T>::Policy &policy, typename FixedExtendedMDP<S, A, T>::Values &bias) {
+    /**
+     * Runs extended value iteration on a FixedExtendedMDP until the span of the difference gets lower than eps
+     * Returns the gain, leaving the corresponding policy in policy and the bias in bias
+     */
+
+    array<double, S> &v = bias;
+    array<double, S> w;
+    array<int, S> order;
+    v.fill(0.0);
+
+    for (int t=0;; t++) {
+        for (int y=0; y<S; y++)
+            order[y] = y;
+        sort(order.begin(), order.end(), [&](int i, int j) {return v[i] > v[j] || (v[i] == v[j] && i < j);});
+
+        for (int x=0; x<S; x++) {
+            double max_q = -INFINITY;
+            for (int a=0; a<A; a++) {
+                double r_opt = extended_mdp.estimated_rewards[x][a] + extended_mdp.reward_uncertainty[x][a];
+                double q = r_opt + fixed_optimize<S>(extended_mdp.estimated_transition_chances[x][a], v, extended_mdp.transition_chance_uncertainty[x][a], order);
+                if (q > max_q) {
+                    max_q = q;
+                    policy[x] = a;
+                }
+            }
+            w[x] = max_q;
+        }
+
+        double max_dv = -INFINITY;
+        double min_dv = INFINITY;
+        for (int x=0; x<S; x++) {
+            max_dv = max(max_dv, w[x]-v[x]);
+            min_dv = min(min_dv, w[x]-v[x]);
+        }
+        for (int x=0; x<S; x++)
+            v[x] = w[x] - w[0];
+
+        if (max_dv-min_dv < eps || t > max_steps)
+            return (max_dv + min_dv)/2;
+    }
+}
+
+#endif
@@ -1,8 +1,13 @@
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <climits>
 #include "mdp.hpp"
+#include "trace.hpp"
 
-MDP::MDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewards, float discount) : actions(actions), transitions(transitions), rewards(rewards), discount(discount) {
+template<typename T>
+BasicMDP<T>::BasicMDP(Matrix<int> &actions, Matrix3D<T> &transitions, Matrix<T> &rewards, float discount) : actions(actions), transitions(transitions), rewards(rewards), discount(discount), pairs(actions) {
     max_reward = 1.0f;
     state = 0;
     t = 0;
@@ -15,7 +20,8 @@ MDP::MDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewa
     this->uniform = uniform;
 }
 
-float MDP::makeAction(int action) {
+template<typename T>
+T BasicMDP<T>::makeAction(int action) {
     // Check if action is available from the current state
     bool valid = false;
     for (int action_: actions[state]) {
@@ -29,13 +35,20 @@ float MDP::makeAction(int action) {
     t++;
 
     // Draw next state
-    vector<float> chances = transitions[state][action];
-    discrete_distribution<> d{chances.begin(), chances.end()};
-    int next_state = d(gen);
+    getSuccessors(state, action, successors);
+    T u = uniform(gen);     // Draws at the precision of the chances, so double models are not sampled at float precision
+    int next_state = successors.back().first;
+    for (auto [y, p]: successors) {
+        if (u < p) {
+            next_state = y;
+            break;
+        }
+        u -= p;
+    }
 
     // Draw rewards (Bernoulli)
-    float chance = rewards[state][action];
-    float reward = (uniform(gen)<=chance) ? max_reward : 0.0f;
+    T chance = rewards[state][action];
+    T reward = (uniform(gen)<=chance) ? max_reward : 0;
 
     total_rewards += reward;
     max_reward *= discount;
@@ -43,68 +56,109 @@ float MDP::makeAction(int action) {
     return reward;
 }
 
-int MDP::getState() {
+template<typename T>
+unique_ptr<BasicMDP<T>> BasicMDP<T>::clone() {
+    /* Copy of the MDP, keeping the actual type of implicit MDPs */
+    return make_unique<BasicMDP<T>>(*this);
+}
+
+template<typename T>
+void BasicMDP<T>::getSuccessors(int x, int action, SparseVector<T> &successors) {
+    /* Get states reachable from state x with action a, with their chances (i.e. p(y|x,a) for y such that p(y|x,a) > 0) */
+    successors.clear();
+    vector<T> &chances = transitions[x][action];
+    for (int y=0; y<(int) chances.size(); y++)
+        if (chances[y] > 0)
+            successors.push_back({y, chances[y]});
+}
+
+template<typename T>
+void BasicMDP<T>::seed(unsigned int seed) {
+    /* Reseeds the random generator, e.g. to run independent copies of the MDP */
+    gen.seed(seed);
+}
+
+template<typename T>
+int BasicMDP<T>::getState() {
     return state;
 }
 
-int MDP::getStates() {
-    return transitions.size();
+template<typename T>
+int BasicMDP<T>::getStates() {
+    return actions.size();
 }
 
-int MDP::getMaxAction() {
-    return transitions[0].size();
+template<typename T>
+int BasicMDP<T>::getMaxAction() {
+    return pairs.max_action;
 }
 
-int MDP::getTime() {
+template<typename T>
+StateActionIndex &BasicMDP<T>::getPairs() {
+    return pairs;
+}
+
+template<typename T>
+int BasicMDP<T>::getTime() {
     return t;
 }
 
-vector<int> &MDP::getAvailableActions() {
+template<typename T>
+vector<int> &BasicMDP<T>::getAvailableActions() {
     return actions[getState()];
 }
 
-vector<int> &MDP::getAvailableActions(int x) {
+template<typename T>
+vector<int> &BasicMDP<T>::getAvailableActions(int x) {
     return actions[x];
 }
 
-Matrix<int> &MDP::getActions() {
+template<typename T>
+Matrix<int> &BasicMDP<T>::getActions() {
     return actions;
 }
 
 
-float MDP::getDiscount() {
+template<typename T>
+float BasicMDP<T>::getDiscount() {
     return discount;
 }
 
-float OfflineMDP::getRewards(int x, int action) {
+template<typename T>
+T BasicOfflineMDP<T>::getRewards(int x, int action) {
     /* Get chance of rewards for a given state-action pair */
     return rewards[x][action];
 }
 
-float OfflineMDP::getTransitionChance(int x, int action, int y) {
+template<typename T>
+T BasicOfflineMDP<T>::getTransitionChance(int x, int action, int y) {
     /* Get chance of transition from state x to state y with action a (i.e. p(y|x,a)) */
-    int n = getStates();
-    int a = getMaxAction();
+    int n = this->getStates();
+    int a = this->getMaxAction();
     if (x<0 || x>=n || y<0 || y>=n || action<0 || action>=a)
         throw invalid_argument("bruh");
-    return transitions[x][action][y];
+    vector<T> &chances = transitions[x][action];
+    return y < (int) chances.size() ? chances[y] : 0;
 }
 
-Matrix<float> &OfflineMDP::getRewardMatrix() {
+template<typename T>
+Matrix<T> &BasicOfflineMDP<T>::getRewardMatrix() {
     return rewards;
 }
 
-Matrix3D<float> &OfflineMDP::getTransitionKernel() {
+template<typename T>
+Matrix3D<T> &BasicOfflineMDP<T>::getTransitionKernel() {
     /* Get transition kernel, i.e. p(y|x,a) for all x, a, y */
     return transitions;
 }
 
-void OfflineMDP::show() {
+template<typename T>
+void BasicOfflineMDP<T>::show() {
     /* Display all MDP information */
 
     // Number of states/actions
-    int n = getStates();
-    int a = getMaxAction();
+    int n = this->getStates();
+    int a = this->getMaxAction();
     cout << "Showing MDP with " << n << " states and " << a << " actions" << endl << endl;
     
     // Available actions from every state
@@ -112,7 +166,7 @@ void OfflineMDP::show() {
     int max_action = 0;
     for (int x=0; x<n; x++) {
         cout << "- " << x << ": ";
-        for (int action: getAvailableActions(x)) {
+        for (int action: this->getAvailableActions(x)) {
             cout << action << " ";
             if (action > max_action)
                 max_action = action;
@@ -145,25 +199,330 @@ void OfflineMDP::show() {
     cout << endl;
 }
 
-void ExtendedMDP::update(MDP &mdp, Matrix<int> &visits, Matrix<float> &observed_rewards, Matrix3D<int> &observed_transitions, int t, double delta) {
+template<typename T>
+BasicImplicitMDP<T>::BasicImplicitMDP(int states, ActionFunction actions, BasicSuccessorFunction<T> successors, BasicRewardFunction<T> rewards, float discount) :
+    BasicOfflineMDP<T>(storage->actions, storage->transitions, storage->rewards, discount), successor_function(successors) {
+    // Tabulate actions and chances for rewards, only transitions are left implicit
+    int max_action = 0;
+    for (int x=0; x<states; x++) {
+        storage->actions.push_back(actions(x));
+        for (int a: storage->actions[x])
+            max_action = max(max_action, a+1);
+    }
+    storage->rewards.assign(states, vector<T>(max_action, 0));
+    for (int x=0; x<states; x++)
+        for (int a: storage->actions[x])
+            storage->rewards[x][a] = rewards(x, a);
+    this->pairs = StateActionIndex(storage->actions);
+}
+
+template<typename T>
+unique_ptr<BasicMDP<T>> BasicImplicitMDP<T>::clone() {
+    return make_unique<BasicImplicitMDP<T>>(*this);
+}
+
+template<typename T>
+void BasicImplicitMDP<T>::getSuccessors(int x, int action, SparseVector<T> &successors) {
+    successors.clear();
+    successor_function(x, action, successors);
+}
+
+template<typename T>
+T BasicImplicitMDP<T>::getTransitionChance(int x, int action, int y) {
+    int n = this->getStates();
+    int a = this->getMaxAction();
+    if (x<0 || x>=n || y<0 || y>=n || action<0 || action>=a)
+        throw invalid_argument("bruh");
+    SparseVector<T> successors;
+    getSuccessors(x, action, successors);
+    for (auto [z, p]: successors)
+        if (z == y)
+            return p;
+    return 0;
+}
+
+template<typename T>
+void BasicExtendedMDP<T>::update(BasicMDP<T> &mdp, vector<int> &visits, vector<T> &observed_rewards, vector<SparseVector<int>> &observed_transitions, int t, double delta) {
+    /* Estimates every legal pair of mdp out of counts indexed by its pairs */
+    TRACE_SPAN(trace, "ExtendedMDP::update");
+    pairs = mdp.getPairs();
     int n = mdp.getStates();
+    estimated_rewards.resize(pairs.size());
+    reward_uncertainty.resize(pairs.size());
+    estimated_transition_chances.resize(pairs.size());
+    transition_chance_uncertainty.resize(pairs.size());
+    for (int k=0; k<pairs.size(); k++) {
+        estimated_rewards[k] = observed_rewards[k] / max(1, visits[k]);
+
+        // Only observed transitions are stored, unvisited pairs keep an empty (uniform) estimate
+        SparseVector<double> &estimate = estimated_transition_chances[k];
+        estimate.clear();
+        if (visits[k] > 0)
+            for (auto [y, count]: observed_transitions[k])
+                estimate.push_back({y, (double) count / visits[k]});
+
+        reward_uncertainty[k] = sqrt(3.5 * log(2*n*mdp.getMaxAction()*t/delta) / max(1, visits[k]));
+        transition_chance_uncertainty[k] = sqrt(14 * log(2*mdp.getMaxAction()*t/delta) / max(1, visits[k]));
+    }
+}
+
+template<typename T>
+double BasicExtendedMDP<T>::getOptimistReward(int k) {
+    return estimated_rewards[k] + reward_uncertainty[k];
+}
+
+template class BasicMDP<float>;
+template class BasicMDP<double>;
+template class BasicOfflineMDP<float>;
+template class BasicOfflineMDP<double>;
+template class BasicImplicitMDP<float>;
+template class BasicImplicitMDP<double>;
+template class BasicExtendedMDP<float>;
+template class BasicExtendedMDP<double>;
+
+template<typename T>
+BasicRollout<T>::BasicRollout(BasicMDP<T> &mdp, Policy &policy) : mdp(mdp), policy(policy), random(mdp.gen()) {
+    int n = mdp.getStates();
+    if (policy.v.empty())
+        throw invalid_argument("Policy does not fit the MDP");
+    for (auto &rule: policy.v) {
+        if ((int) rule.size() != n)
+            throw invalid_argument("Policy does not fit the MDP");
+        for (int x=0; x<n; x++)
+            if (mdp.getPairs().find(x, rule[x]) < 0)
+                throw invalid_argument("Illegal action");
+    }
+
+    actions.resize(n);
+    reward_threshold.resize(n);
+    reward_counts.resize(n);
+    Matrix<pair<int, T>> successors(n);
+
+    int width = 1;
     for (int x=0; x<n; x++) {
-        for (int a: mdp.getAvailableActions(x)) {
-            estimated_rewards[x][a] = observed_rewards[x][a] / max(1, visits[x][a]);
-            for (int y=0; y<n; y++) {
-                estimated_transition_chances[x][a][y] = (double) observed_transitions[x][a][y] / max(1, visits[x][a]);
-                if (visits[x][a] == 0) 
-                    estimated_transition_chances[x][a][y] = 1.0/n;
+        int a = policy(x, 0);
+        actions[x] = a;
+        if (policy.v.size() != 1 || mdp.getDiscount() != 1.0f)
+            continue;
+        reward_threshold[x] = (uint64_t) ldexp(min(max((double) mdp.rewards[x][a], 0.0), 1.0), 32);
+        mdp.getSuccessors(x, a, successors[x]);
+        while (width < (int) successors[x].size())
+            width *= 2;
+    }
+    width_bits = 0;
+    while ((1 << width_bits) < width)
+        width_bits++;
+
+    // Actions of non-stationary policies and rewards of discounted MDPs depend on time, and rows of too large tables overflow,
+    // so all three step through makeAction
+    compiled = policy.v.size() == 1 && mdp.getDiscount() == 1.0f && ((long) n << width_bits) <= INT_MAX;
+    if (!compiled)
+        return;
+
+    // Vose's construction of alias tables out of chances scaled to mean 1, padding entries having chance 0
+    entries.resize((long) n << width_bits);
+    vector<double> scaled(width);
+    vector<int> small, large;
+    for (int x=0; x<n; x++) {
+        AliasEntry *table = &entries[(long) x << width_bits];
+        double total = 0.0;
+        for (auto [y, p]: successors[x])
+            total += p;
+        small.clear();
+        large.clear();
+        for (int i=0; i<width; i++) {
+            int y = i < (int) successors[x].size() ? successors[x][i].first : successors[x][0].first;
+            scaled[i] = i < (int) successors[x].size() ? successors[x][i].second * width / total : 0.0;
+            table[i] = {(uint64_t) 1 << 32, y << width_bits, y << width_bits};
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int i = small.back(), j = large.back();
+            small.pop_back();
+            table[i].threshold = (uint64_t) ldexp(scaled[i], 32);
+            table[i].alias = table[j].successor;
+            scaled[j] -= 1.0 - scaled[i];
+            if (scaled[j] < 1.0) {
+                large.pop_back();
+                small.push_back(j);
             }
+        }
+        // Entries left over only differ from 1 by rounding, and keep threshold 2^32
+    }
+}
+
+template<typename T>
+void BasicRollout<T>::seed(uint64_t seed) {
+    random.seed(seed);
+    if (!compiled)
+        mdp.seed(seed);
+}
+
+template<typename T>
+template<bool limited, bool logged>
+long BasicRollout<T>::loop(long steps, vector<long> &visits, vector<double> &rewards, const vector<long> *limits, History *log) {
+    int row = mdp.state << width_bits;
+    int shift = 32 - width_bits;
+    const AliasEntry *table = entries.data();
+    const uint64_t *reward_table = reward_threshold.data();
+    long *visit_counts = visits.data();
+    long *rewarded = reward_counts.data();
+    FastRandom local_random = random;   // Local copy, kept in registers as it cannot alias the counts
+    fill(reward_counts.begin(), reward_counts.end(), 0);
+
+    long t = 0;
+    for (; t<steps; t++) {
+        int x = row >> width_bits;
+        if (limited && visit_counts[x] >= (*limits)[x])
+            break;
+
+        uint64_t r = local_random.next();
+        const AliasEntry &entry = table[row | (int) ((r >> 32) >> shift)];
+        int next_row = ((r & 0xffffffff) < entry.threshold) ? entry.successor : entry.alias;
+        long reward = (local_random.next() >> 32) < reward_table[x];
+
+        visit_counts[x]++;
+        rewarded[x] += reward;
+        if (logged)
+            log->push_back(Event(x, actions[x], next_row >> width_bits, reward));
+        row = next_row;
+    }
+
+    long total = 0;
+    for (int z=0; z<(int) rewards.size(); z++) {
+        rewards[z] += rewarded[z];
+        total += rewarded[z];
+    }
+    random = local_random;
+    mdp.state = row >> width_bits;
+    mdp.t += t;
+    mdp.total_rewards += total;
+    return t;
+}
+
+template<typename T>
+template<bool limited, bool logged>
+long BasicRollout<T>::stepLoop(long steps, vector<long> &visits, vector<double> &rewards, const vector<long> *limits, History *log) {
+    long t = 0;
+    for (; t<steps; t++) {
+        int x = mdp.state;
+        if (limited && visits[x] >= (*limits)[x])
+            break;
+
+        int action = policy(x, mdp.t);
+        T reward = mdp.makeAction(action);
+        visits[x]++;
+        if (!rewards.empty())
+            rewards[x] += reward;
+        if (logged)
+            log->push_back(Event(x, action, mdp.state, reward));
+    }
+    return t;
+}
+
+template<typename T>
+long BasicRollout<T>::run(long steps, vector<long> &visits, vector<double> &rewards, History *log) {
+    /**
+     * Plays the policy for steps steps
+     * Adds to visits[x] and rewards[x] the number of steps played from state x and the rewards they got, and appends every step to log if given
+     * rewards may be left empty when only visits matter
+     * Returns the number of steps played
+     */
+    if (!compiled)
+        return log ? stepLoop<false, true>(steps, visits, rewards, nullptr, log) : stepLoop<false, false>(steps, visits, rewards, nullptr, nullptr);
+    if (log)
+        return loop<false, true>(steps, visits, rewards, nullptr, log);
+    return loop<false, false>(steps, visits, rewards, nullptr, nullptr);
+}
+
+template<typename T>
+long BasicRollout<T>::runUntil(long steps, vector<long> &visits, const vector<long> &limits, vector<double> &rewards, History *log) {
+    /**
+     * Same as run, stopping early in a state x where visits[x] reached limits[x]
+     * Returns the number of steps played
+     */
+    if (!compiled)
+        return log ? stepLoop<true, true>(steps, visits, rewards, &limits, log) : stepLoop<true, false>(steps, visits, rewards, &limits, nullptr);
+    if (log)
+        return loop<true, true>(steps, visits, rewards, &limits, log);
+    return loop<true, false>(steps, visits, rewards, &limits, nullptr);
+}
+
+template class BasicRollout<float>;
+template class BasicRollout<double>;
+
+void sparse_increment(SparseVector<int> &v, int i) {
+    /* Adds 1 to v[i], inserting i in the support if needed */
+    auto it = lower_bound(v.begin(), v.end(), i, [](const pair<int, int> &e, int i) {return e.first < i;});
+    if (it != v.end() && it->first == i)
+        it->second++;
+    else
+        v.insert(it, {i, 1});
+}
+
+void sparse_merge(SparseVector<int> &v, SparseVector<int> &w) {
+    /* Adds w to v and clears w, keeping its capacity */
+    if (w.empty())
+        return;
+
+    SparseVector<int> sum;
+    sum.reserve(v.size() + w.size());
+    auto i = v.begin(), j = w.begin();
+    while (i != v.end() || j != w.end()) {
+        if (j == w.end() || (i != v.end() && i->first < j->first))
+            sum.push_back(*i++);
+        else if (i == v.end() || j->first < i->first)
+            sum.push_back(*j++);
+        else {
+            sum.push_back({i->first, i->second + j->second});
+            i++;
+            j++;
+        }
+    }
+    v.swap(sum);
+    w.clear();
+}
 
-            reward_uncertainty[x][a] = sqrt(3.5 * log(2*n*mdp.getMaxAction()*t/delta) / max(1, visits[x][a]));
-            transition_chance_uncertainty[x][a] = sqrt(14 * log(2*mdp.getMaxAction()*t/delta) / max(1, visits[x][a]));
+StateActionIndex::StateActionIndex(Matrix<int> &actions) : offsets(1, 0), max_action(0), lookup_offsets(1, 0) {
+    for (int x=0; x<(int) actions.size(); x++) {
+        int low = INT_MAX, high = INT_MIN;
+        bool consecutive = true;
+        for (int i=0; i<(int) actions[x].size(); i++) {
+            int a = actions[x][i];
+            this->actions.push_back(a);
+            states.push_back(x);
+            max_action = max(max_action, a+1);
+            low = min(low, a);
+            high = max(high, a);
+            consecutive &= (a == actions[x][0] + i);
+        }
+        offsets.push_back(this->actions.size());
+        first_action.push_back(actions[x].empty() ? 0 : low);
+
+        // Only states with gaps or unordered actions need a table
+        if (!consecutive) {
+            lookup.resize(lookup.size() + high - low + 1, -1);
+            for (int k=offsets[x]; k<offsets[x+1]; k++)
+                lookup[lookup_offsets[x] + this->actions[k] - low] = k;
         }
+        lookup_offsets.push_back(lookup.size());
     }
 }
 
-double ExtendedMDP::getOptimistReward(int x, int a) {
-    return estimated_rewards[x][a] + reward_uncertainty[x][a];
+int StateActionIndex::size() {
+    return actions.size();
+}
+
+int StateActionIndex::find(int x, int action) {
+    /* Returns the pair of action in state x, -1 if action is not available from x */
+    int i = action - first_action[x];
+    if (lookup_offsets[x] == lookup_offsets[x+1])
+        return (i >= 0 && i < offsets[x+1] - offsets[x]) ? offsets[x] + i : -1;
+    return (i >= 0 && i < lookup_offsets[x+1] - lookup_offsets[x]) ? lookup[lookup_offsets[x] + i] : -1;
+}
+
+bool StateActionIndex::operator==(const StateActionIndex &other) const {
+    return offsets == other.offsets && actions == other.actions;
 }
 
 int Policy::operator()(int state, int t) {
@@ -171,32 +530,77 @@ int Policy::operator()(int state, int t) {
     return v[t][state];
 }
 
-MDP &Agent::getMDP() {
+size_t hash_policy(Policy &policy) {
+    /* Hash of a policy's content, combining its decision rules step by step */
+    size_t h = policy.v.size();
+    for (auto &rule: policy.v) {
+        h ^= rule.size() + 0x9e3779b9 + (h << 6) + (h >> 2);
+        for (int a: rule)
+            h ^= hash<int>()(a) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+    return h;
+}
+
+int PolicyStore::intern(Policy &policy) {
+    /* Returns the ID of policy, storing a copy of it if no equal policy was stored before */
+    int id = find(policy);
+    if (id >= 0)
+        return id;
+
+    id = policies.size();
+    policies.push_back(policy);
+    ids.insert({hash_policy(policy), id});
+    return id;
+}
+
+int PolicyStore::find(Policy &policy) {
+    /* Returns the ID of a stored policy equal to policy, -1 if there is none */
+    auto range = ids.equal_range(hash_policy(policy));
+    for (auto it = range.first; it != range.second; it++)
+        if (policies[it->second].v == policy.v)
+            return it->second;
+    return -1;
+}
+
+Policy &PolicyStore::get(int id) {
+    /* Reference is invalidated when a new policy is interned */
+    return policies[id];
+}
+
+int PolicyStore::size() {
+    return policies.size();
+}
+
+template<typename T>
+BasicMDP<T> &BasicAgent<T>::getMDP() {
     return mdp;
 }
 
-int Agent::makeRandomAction(float &f) {
+template<typename T>
+int BasicAgent<T>::makeRandomAction(T &f) {
     /**
      * Chooses and makes a random action among those available from the current state
      * Saves rewards to f
      * Returns ID of action chosen
      */
-    vector<int> actions = mdp.getAvailableActions();
+    vector<int> &actions = mdp.getAvailableActions();
     int action = actions[rand() % actions.size()];
     f = mdp.makeAction(action);
     return action;
 }
 
-int Agent::makeRandomAction() {
+template<typename T>
+int BasicAgent<T>::makeRandomAction() {
     /**
      * Chooses and makes a random action
      * Returns ID of action chosen
      */
-    float f;
+    T f;
     return makeRandomAction(f);
 }
 
-int Agent::usePolicy(float &f) {
+template<typename T>
+int BasicAgent<T>::usePolicy(T &f) {
     /**
      * Plays one step of the agent's policy
      * Saves rewards to f
@@ -209,15 +613,19 @@ int Agent::usePolicy(float &f) {
     return action;
 }
 
-int Agent::usePolicy() {
+template<typename T>
+int BasicAgent<T>::usePolicy() {
     /**
      * Plays one step of the agent's policy
      * Returns action chosen
      */
-    float f;
+    T f;
     return usePolicy(f);
 }
 
+template class BasicAgent<float>;
+template class BasicAgent<double>;
+
 void show_policy(Policy &policy) {
     int steps = size(policy.v);
     if (steps>1)
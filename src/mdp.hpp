@@ -3,6 +3,11 @@
 
 #include <vector>
 #include <random>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+#include <tuple>
+#include <cstdint>
 
 using namespace std;
 
@@ -12,31 +17,115 @@ using Matrix = vector<vector<T>>;
 template<typename T>
 using Matrix3D = vector<vector<vector<T>>>;
 
-class MDP {
+template<typename T>
+using SparseVector = vector<pair<int, T>>;  // (index, value) pairs sorted by index, missing indices are 0
+
+using Event = tuple<int, int, int, double>;
+using History = vector<Event>;
+
+void sparse_increment(SparseVector<int> &v, int i);
+void sparse_merge(SparseVector<int> &v, SparseVector<int> &w);
+
+template<typename T>
+class BasicRollout;
+
+class StateActionIndex {
+    /**
+     *  Ragged layout of the legal state-action pairs of a model, numbered state by state in the order of the available actions
+     *  Pairs of state x are offsets[x] to offsets[x+1]-1, so tables indexed by pair hold one entry per legal pair instead of S*A_max
+     *  find is O(1): states whose actions are first_action[x], first_action[x]+1, ... compute the pair, others look it up in a table
+     *  spanning their range of action IDs
+     */
+
+    public:
+    vector<int> offsets;            // offsets[x] := first pair of state x, offsets[S] := number of pairs
+    vector<int> actions;            // actions[k] := global action ID of pair k
+    vector<int> states;             // states[k] := state of pair k
+    int max_action;                 // Highest action ID + 1
+    vector<int> first_action;       // first_action[x] := lowest action ID available from x
+    vector<int> lookup_offsets;     // Table of state x is lookup[lookup_offsets[x]..lookup_offsets[x+1]-1], empty if its actions are consecutive
+    vector<int> lookup;             // lookup[lookup_offsets[x] + action - first_action[x]] := pair of action in state x, -1 if illegal
+
+    StateActionIndex() : offsets(1, 0), max_action(0), lookup_offsets(1, 0) {}
+    StateActionIndex(Matrix<int> &actions);
+    int size();
+    int find(int x, int action);
+    bool operator==(const StateActionIndex &other) const;
+};
+
+class FastRandom {
+    /**
+     *  xoshiro256+ generator, seeded through splitmix64, for simulations where mt19937 dominates the cost of a step
+     */
+
+    private:
+    uint64_t s[4];
+
+    public:
+    FastRandom(uint64_t seed = 0) {
+        this->seed(seed);
+    }
+
+    void seed(uint64_t seed) {
+        for (int i=0; i<4; i++) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            s[i] = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = s[0] + s[3];
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = (s[3] << 45) | (s[3] >> 19);
+        return result;
+    }
+};
+
+template<typename T>
+class BasicMDP {
     /**
      *  Markov decision process with hidden information on transitions, actions and rewards, for use in RL
      *  Rewards are Bernoulli
+     *  Chances are stored with scalar type T, instantiated for float and double
      */
 
     private:
     Matrix<int> &actions;           // Available actions: actions[x] := vector of actions available from state x
-    Matrix3D<float> &transitions;   // Transition kernel: transitions[x][a][y] := p(y | x, a)
-    Matrix<float> &rewards;         // Chance for reward: R(x, a) ~ B(rewards[x][a])
+    Matrix3D<T> &transitions;       // Transition kernel: transitions[x][a][y] := p(y | x, a), rows of illegal pairs may be left empty
+    Matrix<T> &rewards;             // Chance for reward: R(x, a) ~ B(rewards[x][a])
     float discount;
     int state;
     int t;
-    float max_reward;
-    float total_rewards;
+    T max_reward;
+    T total_rewards;
     mt19937 gen;
     uniform_real_distribution<> uniform;
+    SparseVector<T> successors;
+
+    friend class BasicRollout<T>;
+
+    protected:
+    StateActionIndex pairs;         // Legal pairs, indexing learner and solver tables
 
     public:
-    MDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewards, float discount);
-    MDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewards) : MDP(actions, transitions, rewards, 1.0f) {}
-    float makeAction(int action);
+    BasicMDP(Matrix<int> &actions, Matrix3D<T> &transitions, Matrix<T> &rewards, float discount);
+    BasicMDP(Matrix<int> &actions, Matrix3D<T> &transitions, Matrix<T> &rewards) : BasicMDP(actions, transitions, rewards, 1.0f) {}
+    virtual ~BasicMDP() = default;
+    virtual unique_ptr<BasicMDP> clone();
+    virtual void getSuccessors(int x, int action, SparseVector<T> &successors);
+    T makeAction(int action);
+    void seed(unsigned int seed);
     int getState();
     int getStates();
     int getMaxAction();
+    StateActionIndex &getPairs();
     int getTime();
     vector<int> &getAvailableActions();
     vector<int> &getAvailableActions(int x);
@@ -44,40 +133,92 @@ class MDP {
     float getDiscount();
 };
 
-class OfflineMDP: public MDP {
+template<typename T>
+class BasicOfflineMDP: public BasicMDP<T> {
     /**
      *  Markov decision process with public information on transitions, actions and rewards
      */
 
     public:
     Matrix<int> &actions;
-    Matrix3D<float> &transitions;
-    Matrix<float> &rewards;
+    Matrix3D<T> &transitions;
+    Matrix<T> &rewards;
     
-    OfflineMDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewards, float discount) : MDP(actions, transitions, rewards, discount), actions(actions), transitions(transitions), rewards(rewards) {}
-    OfflineMDP(Matrix<int> &actions, Matrix3D<float> &transitions, Matrix<float> &rewards) : OfflineMDP(actions, transitions, rewards, 1.0f) {}
-    float getRewards(int x, int action);
-    float getTransitionChance(int x, int action, int y);
-    Matrix<float> &getRewardMatrix();
-    Matrix3D<float> &getTransitionKernel();
+    BasicOfflineMDP(Matrix<int> &actions, Matrix3D<T> &transitions, Matrix<T> &rewards, float discount) : BasicMDP<T>(actions, transitions, rewards, discount), actions(actions), transitions(transitions), rewards(rewards) {}
+    BasicOfflineMDP(Matrix<int> &actions, Matrix3D<T> &transitions, Matrix<T> &rewards) : BasicOfflineMDP(actions, transitions, rewards, 1.0f) {}
+    T getRewards(int x, int action);
+    virtual T getTransitionChance(int x, int action, int y);
+    Matrix<T> &getRewardMatrix();
+    Matrix3D<T> &getTransitionKernel();
     void show();
 };
 
-class ExtendedMDP {
+using ActionFunction = function<vector<int>(int x)>;
+template<typename T>
+using BasicSuccessorFunction = function<void(int x, int action, SparseVector<T> &successors)>;
+template<typename T>
+using BasicRewardFunction = function<T(int x, int action)>;
+
+template<typename T>
+struct ImplicitStorage {
+    Matrix<int> actions;
+    Matrix3D<T> transitions;        // Always empty
+    Matrix<T> rewards;
+};
+
+template<typename T>
+class ImplicitStorageHolder {
+    protected:
+    shared_ptr<ImplicitStorage<T>> storage;
+    ImplicitStorageHolder() : storage(make_shared<ImplicitStorage<T>>()) {}
+};
+
+template<typename T>
+class BasicImplicitMDP: private ImplicitStorageHolder<T>, public BasicOfflineMDP<T> {
+    /**
+     *  Markov decision process whose transition kernel is never materialized
+     *  Transitions are generated by a callback giving the successors of (x, a) with their chances, sorted by state
+     *  Actions and chances for rewards are tabulated once, so memory is O(S*A) instead of O(S^2*A)
+     *  Copies share the same tables, as copies of other MDPs share their matrices
+     *  Functions reading the whole kernel through getTransitionKernel() need a stored model
+     */
+
+    private:
+    using ImplicitStorageHolder<T>::storage;
+    BasicSuccessorFunction<T> successor_function;
+
+    public:
+    BasicImplicitMDP(int states, ActionFunction actions, BasicSuccessorFunction<T> successors, BasicRewardFunction<T> rewards, float discount);
+    BasicImplicitMDP(int states, ActionFunction actions, BasicSuccessorFunction<T> successors, BasicRewardFunction<T> rewards) : BasicImplicitMDP(states, actions, successors, rewards, 1.0f) {}
+    unique_ptr<BasicMDP<T>> clone() override;
+    void getSuccessors(int x, int action, SparseVector<T> &successors) override;
+    T getTransitionChance(int x, int action, int y) override;
+};
+
+template<typename T>
+class BasicExtendedMDP {
+    /**
+     *  Optimistic MDP built by UCRL2 out of observed counts
+     *  Counts and estimates are indexed by the legal pairs of the model they were observed on, whose layout is kept in pairs
+     *  Estimates are double whatever the scalar type T of the model's chances and observed rewards
+     *  Estimated transition chances are only stored on the observed support, an empty support standing for the uniform estimate of an unvisited pair
+     */
+
     public:
-    Matrix<double> &estimated_rewards;
-    Matrix<double> &reward_uncertainty;
-    Matrix3D<double> &estimated_transition_chances;
-    Matrix<double> &transition_chance_uncertainty;
+    StateActionIndex pairs;
+    vector<double> &estimated_rewards;
+    vector<double> &reward_uncertainty;
+    vector<SparseVector<double>> &estimated_transition_chances;
+    vector<double> &transition_chance_uncertainty;
 
-    ExtendedMDP(Matrix<double> &estimated_rewards, Matrix<double> &reward_uncertainty, Matrix3D<double> &estimated_transition_chances, Matrix<double> &transition_chance_uncertainty) :
+    BasicExtendedMDP(vector<double> &estimated_rewards, vector<double> &reward_uncertainty, vector<SparseVector<double>> &estimated_transition_chances, vector<double> &transition_chance_uncertainty) :
         estimated_rewards(estimated_rewards),
         reward_uncertainty(reward_uncertainty),
         estimated_transition_chances(estimated_transition_chances),
         transition_chance_uncertainty(transition_chance_uncertainty) {}
 
-    void update(MDP &mdp, Matrix<int> &visits, Matrix<float> &observed_rewards, Matrix3D<int> &observed_transitions, int t, double delta);
-    double getOptimistReward(int x, int a);
+    void update(BasicMDP<T> &mdp, vector<int> &visits, vector<T> &observed_rewards, vector<SparseVector<int>> &observed_transitions, int t, double delta);
+    double getOptimistReward(int k);
 };
 
 struct Policy {
@@ -85,20 +226,90 @@ struct Policy {
     int operator()(int state, int t);
 };
 
-class Agent {
+class PolicyStore {
+    /**
+     *  Interns policies by content: equal policies are stored once and share one ID
+     *  IDs are indices in order of first insertion, so policies compare by ID
+     */
+
     private:
-    MDP &mdp;
+    vector<Policy> policies;
+    unordered_multimap<size_t, int> ids;    // ids := content hash -> IDs of policies with that hash
+
+    public:
+    int intern(Policy &policy);
+    int find(Policy &policy);
+    Policy &get(int id);
+    int size();
+};
+
+template<typename T>
+class BasicAgent {
+    private:
+    BasicMDP<T> &mdp;
     Policy &policy;
     
     public:
-    Agent(MDP &mdp, Policy &policy) : mdp(mdp), policy(policy) {}
-    MDP &getMDP();
-    int makeRandomAction(float &f);
+    BasicAgent(BasicMDP<T> &mdp, Policy &policy) : mdp(mdp), policy(policy) {}
+    BasicMDP<T> &getMDP();
+    int makeRandomAction(T &f);
     int makeRandomAction();
-    int usePolicy(float &f);
+    int usePolicy(T &f);
     int usePolicy();
 };
 
+template<typename T>
+class BasicRollout {
+    /**
+     *  Markov chain induced by a policy on an MDP, compiled once for long simulations
+     *  Successors of every state are drawn in O(1) from an alias table (Walker's method), rewards with one comparison,
+     *  both out of 32-bit thresholds compared to a FastRandom seeded from the MDP's own generator
+     *  Alias tables are padded to a common power of two size, so that a draw is a shift and a single entry load
+     *  Runs continue from the MDP's state, and leave the MDP in the state, time and total rewards they reached
+     *  Non-stationary policies, discounted MDPs, and MDPs whose padded tables cannot be indexed by an int are played step by step with makeAction instead
+     *  The constructor checks every action of the policy, so that runs cannot fail, e.g. on worker threads
+     */
+
+    private:
+    struct AliasEntry {
+        uint64_t threshold;             // successor is drawn iff a 32-bit draw is below threshold, alias otherwise
+        int successor;                  // Successors are stored as the first entry of their own alias table, y<<width_bits
+        int alias;
+    };
+
+    BasicMDP<T> &mdp;
+    Policy policy;
+    vector<int> actions;                // actions[x] := action of a stationary policy in state x
+    vector<uint64_t> reward_threshold;  // Reward iff a 32-bit draw is below reward_threshold[x]
+    int width_bits;                     // Alias table of state x spans entries x<<width_bits to (x+1)<<width_bits - 1
+    vector<AliasEntry> entries;
+    vector<long> reward_counts;
+    FastRandom random;
+    bool compiled;                      // Whether runs use alias tables rather than makeAction
+
+    template<bool limited, bool logged>
+    long loop(long steps, vector<long> &visits, vector<double> &rewards, const vector<long> *limits, History *log);
+    template<bool limited, bool logged>
+    long stepLoop(long steps, vector<long> &visits, vector<double> &rewards, const vector<long> *limits, History *log);
+
+    public:
+    BasicRollout(BasicMDP<T> &mdp, Policy &policy);
+    void seed(uint64_t seed);
+    long run(long steps, vector<long> &visits, vector<double> &rewards, History *log = nullptr);
+    long runUntil(long steps, vector<long> &visits, const vector<long> &limits, vector<double> &rewards, History *log = nullptr);
+};
+
+// Models, learners and agents in single precision, as used throughout
+using MDP = BasicMDP<float>;
+using OfflineMDP = BasicOfflineMDP<float>;
+using ImplicitMDP = BasicImplicitMDP<float>;
+using ExtendedMDP = BasicExtendedMDP<float>;
+using Agent = BasicAgent<float>;
+using Rollout = BasicRollout<float>;
+using SuccessorFunction = BasicSuccessorFunction<float>;
+using RewardFunction = BasicRewardFunction<float>;
+
+size_t hash_policy(Policy &policy);
 void show_policy(Policy &policy);
 
 #endif
\ No newline at end of file
@@ -1,15 +1,18 @@
 #include "../mdp.hpp"
+#include "../fixed_mdp.hpp"
 #include <tuple>
 
 #define LEFT 0
 #define RIGHT 1
 using namespace std;
 
-tuple<Matrix<int>, Matrix3D<float>, Matrix<float>> Riverswim(int n, float progress_chance, float flow_back_chance, float lazy_reward, float win_reward) {
-    float halt_chance = 1.0 - progress_chance - flow_back_chance;
+template<typename T = float>
+tuple<Matrix<int>, Matrix3D<T>, Matrix<T>> Riverswim(int n, double progress_chance, double flow_back_chance, double lazy_reward, double win_reward) {
+    /* Riverswim model with chances stored in scalar type T, e.g. Riverswim<double>(...) for a double precision model */
+    T halt_chance = 1.0 - progress_chance - flow_back_chance;
     
     Matrix<int> actions(n, {LEFT, RIGHT});
-    Matrix3D<float> transitions(n, Matrix<float>(2, vector<float>(n, 0.0)));
+    Matrix3D<T> transitions(n, Matrix<T>(2, vector<T>(n, 0.0)));
     
     for (int x=1; x<n-1; x++) {
         transitions[x][RIGHT][x+1] = progress_chance;
@@ -24,9 +27,72 @@ tuple<Matrix<int>, Matrix3D<float>, Matrix<float>> Riverswim(int n, float progre
     transitions[n-1][RIGHT][n-2] = flow_back_chance;
     transitions[n-1][LEFT][n-2] = 1.0;
 
-    Matrix<float> rewards(n, {0.0, 0.0});
+    Matrix<T> rewards(n, {0.0, 0.0});
     rewards[0][LEFT] = lazy_reward;
     rewards[n-1][RIGHT] = win_reward;
 
     return tuple(actions, transitions, rewards);
-}
\ No newline at end of file
+}
+
+template<typename T = float>
+BasicImplicitMDP<T> ImplicitRiverswim(int n, double progress_chance, double flow_back_chance, double lazy_reward, double win_reward) {
+    /* Same model as Riverswim, with transitions generated on demand instead of stored in an n*2*n kernel */
+    T halt_chance = 1.0 - progress_chance - flow_back_chance;
+
+    auto actions = [](int) {return vector<int>({LEFT, RIGHT});};
+
+    auto successors = [=](int x, int a, SparseVector<T> &successors) {
+        if (a == LEFT) {
+            successors.push_back({max(x-1, 0), 1});
+            return;
+        }
+        if (x == 0) {
+            successors.push_back({0, halt_chance});
+            successors.push_back({1, T(progress_chance + flow_back_chance)});
+        }
+        else if (x == n-1) {
+            successors.push_back({n-2, T(flow_back_chance)});
+            successors.push_back({n-1, T(progress_chance + halt_chance)});
+        }
+        else {
+            successors.push_back({x-1, T(flow_back_chance)});
+            successors.push_back({x, halt_chance});
+            successors.push_back({x+1, T(progress_chance)});
+        }
+    };
+
+    auto rewards = [=](int x, int a) -> T {
+        if (x == 0 && a == LEFT)
+            return lazy_reward;
+        if (x == n-1 && a == RIGHT)
+            return win_reward;
+        return 0;
+    };
+
+    return BasicImplicitMDP<T>(n, actions, successors, rewards);
+}
+
+template<int S, typename T = float>
+constexpr FixedMDP<S, 2, T> FixedRiverswim(double progress_chance, double flow_back_chance, double lazy_reward, double win_reward) {
+    /* Same model as Riverswim with S states, built at compile time into std::array storage */
+    static_assert(S >= 2, "Riverswim needs at least 2 states");
+    T halt_chance = 1.0 - progress_chance - flow_back_chance;
+
+    FixedMDP<S, 2, T> mdp {};
+    for (int x=1; x<S-1; x++) {
+        mdp.transitions[x][RIGHT][x+1] = progress_chance;
+        mdp.transitions[x][RIGHT][x] = halt_chance;
+        mdp.transitions[x][RIGHT][x-1] = flow_back_chance;
+        mdp.transitions[x][LEFT][x-1] = 1.0;
+    }
+    mdp.transitions[0][RIGHT][0] = halt_chance;
+    mdp.transitions[0][RIGHT][1] = progress_chance + flow_back_chance;
+    mdp.transitions[0][LEFT][0] = 1.0;
+    mdp.transitions[S-1][RIGHT][S-1] = progress_chance + halt_chance;
+    mdp.transitions[S-1][RIGHT][S-2] = flow_back_chance;
+    mdp.transitions[S-1][LEFT][S-2] = 1.0;
+
+    mdp.rewards[0][LEFT] = lazy_reward;
+    mdp.rewards[S-1][RIGHT] = win_reward;
+    return mdp;
+}
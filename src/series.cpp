@@ -0,0 +1,118 @@
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include "series.hpp"
+
+Series::Series(int capacity) : capacity(capacity) {
+    if (capacity<2 || capacity%2)
+        throw invalid_argument("capacity must be a positive even number");
+    width = 1;
+    steps = 0;
+    buckets.reserve(capacity);
+}
+
+void Series::coarsen() {
+    /* Doubles bucket width, merging buckets 2k and 2k+1 into bucket k */
+    int m = (buckets.size()+1) / 2;
+    for (int k=0; k<m; k++) {
+        Bucket b = buckets[2*k];
+        if (2*k+1 < (int) buckets.size()) {
+            Bucket &c = buckets[2*k+1];
+            b.min = min(b.min, c.min);
+            b.max = max(b.max, c.max);
+            b.sum += c.sum;
+            b.count += c.count;
+        }
+        buckets[k] = b;
+    }
+    buckets.resize(m);
+    width *= 2;
+}
+
+void Series::push(double y) {
+    /* Appends the value of the curve at the next step */
+    if (steps / width == capacity)
+        coarsen();
+
+    long k = steps / width;
+    if (k == (long) buckets.size())
+        buckets.push_back({y, y, y, 1});
+    else {
+        Bucket &b = buckets[k];
+        b.min = min(b.min, y);
+        b.max = max(b.max, y);
+        b.sum += y;
+        b.count++;
+    }
+    steps++;
+}
+
+void Series::merge(Series &other) {
+    /**
+     * Merges the curve of another run (e.g. another seed) over the same steps into this one
+     * Buckets then hold the envelope of both curves, and means are taken over both
+     */
+
+    Series o = other;
+    while (width < o.width)
+        coarsen();
+    while (o.width < width)
+        o.coarsen();
+
+    if (o.buckets.size() > buckets.size())
+        buckets.resize(o.buckets.size(), {INFINITY, -INFINITY, 0.0, 0});
+    for (int k=0; k<(int) o.buckets.size(); k++) {
+        Bucket &b = buckets[k];
+        Bucket &c = o.buckets[k];
+        b.min = min(b.min, c.min);
+        b.max = max(b.max, c.max);
+        b.sum += c.sum;
+        b.count += c.count;
+    }
+    steps = max(steps, o.steps);
+    while ((int) buckets.size() > capacity)
+        coarsen();
+}
+
+long Series::getSteps() {
+    return steps;
+}
+
+vector<double> Series::getX() {
+    /* Middle step of every bucket, steps being numbered from 1 */
+    vector<double> x;
+    for (int k=0; k<(int) buckets.size(); k++)
+        x.push_back(k*width + min(width, steps - k*width) / 2.0 + 0.5);
+    return x;
+}
+
+vector<double> Series::getMins() {
+    vector<double> y;
+    for (Bucket &b: buckets)
+        y.push_back(b.min);
+    return y;
+}
+
+vector<double> Series::getMaxs() {
+    vector<double> y;
+    for (Bucket &b: buckets)
+        y.push_back(b.max);
+    return y;
+}
+
+vector<double> Series::getMeans() {
+    vector<double> y;
+    for (Bucket &b: buckets)
+        y.push_back(b.sum / b.count);
+    return y;
+}
+
+void Series::save(string path) {
+    /* Exports the downsampled curve as CSV */
+    ofstream file(path);
+    vector<double> x = getX();
+    file << "step,min,mean,max" << endl;
+    for (int k=0; k<(int) buckets.size(); k++)
+        file << x[k] << "," << buckets[k].min << "," << buckets[k].sum / buckets[k].count << "," << buckets[k].max << endl;
+}
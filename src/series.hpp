@@ -0,0 +1,43 @@
+#ifndef SERIES_HEADER
+#define SERIES_HEADER
+
+#include <vector>
+#include <string>
+
+using namespace std;
+
+struct Bucket {
+    double min;
+    double max;
+    double sum;
+    long count;
+};
+
+class Series {
+    /**
+     *  Bounded-memory downsample of a curve y(1), y(2), ... received one step at a time
+     *  Steps are grouped into at most capacity buckets of equal width, each keeping the min, max and mean of its points
+     *  When all buckets are used, the width doubles and neighbouring buckets are merged, so min/max envelopes are preserved
+     */
+
+    private:
+    int capacity;
+    long width;                 // Steps per bucket, always a power of 2
+    long steps;
+    vector<Bucket> buckets;
+    void coarsen();
+
+    public:
+    Series(int capacity);
+    Series() : Series(1024) {}
+    void push(double y);
+    void merge(Series &other);
+    long getSteps();
+    vector<double> getX();
+    vector<double> getMins();
+    vector<double> getMaxs();
+    vector<double> getMeans();
+    void save(string path);
+};
+
+#endif
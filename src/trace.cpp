@@ -0,0 +1,80 @@
+#ifdef MDP_TRACE
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "trace.hpp"
+
+struct TraceEvent {
+    const char *name;
+    double start;           // Microseconds since the first span of the process
+    double duration;
+    pair<const char *, double> args[TRACE_MAX_ARGS];
+    int n_args;
+};
+
+struct TraceBuffer {
+    int tid;
+    vector<TraceEvent> events;
+};
+
+// Every thread appends to its own buffer, buffers are only shared when registering and saving
+static mutex buffers_mutex;
+static vector<unique_ptr<TraceBuffer>> buffers;
+static thread_local TraceBuffer *buffer = nullptr;
+static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+static double now() {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - epoch).count();
+}
+
+static TraceBuffer &thread_buffer() {
+    if (buffer == nullptr) {
+        lock_guard<mutex> lock(buffers_mutex);
+        buffers.push_back(make_unique<TraceBuffer>());
+        buffer = buffers.back().get();
+        buffer->tid = buffers.size();
+    }
+    return *buffer;
+}
+
+TraceSpan::TraceSpan(const char *name) : name(name), n_args(0) {
+    start = now();
+}
+
+TraceSpan::~TraceSpan() {
+    TraceEvent event = {name, start, now() - start, {}, n_args};
+    for (int i=0; i<n_args; i++)
+        event.args[i] = args[i];
+    thread_buffer().events.push_back(event);
+}
+
+void TraceSpan::arg(const char *key, double value) {
+    /* Arguments past TRACE_MAX_ARGS are dropped */
+    if (n_args < TRACE_MAX_ARGS)
+        args[n_args++] = {key, value};
+}
+
+void trace_save(string path) {
+    /* Writes recorded spans as complete ("X") events of the Chrome trace event format */
+    lock_guard<mutex> lock(buffers_mutex);
+    ofstream file(path);
+    file << "{\"traceEvents\":[";
+    bool first = true;
+    for (auto &b: buffers) {
+        for (TraceEvent &e: b->events) {
+            file << (first ? "" : ",") << endl;
+            first = false;
+            file << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                 << ",\"ts\":" << fixed << e.start << ",\"dur\":" << e.duration << defaultfloat << ",\"args\":{";
+            for (int i=0; i<e.n_args; i++)
+                file << (i ? "," : "") << "\"" << e.args[i].first << "\":" << e.args[i].second;
+            file << "}}";
+        }
+    }
+    file << endl << "]}" << endl;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef TRACE_HEADER
+#define TRACE_HEADER
+
+/**
+ *  Scoped trace spans, exported as Chrome/Perfetto trace JSON
+ *  Spans are only recorded when compiled with MDP_TRACE, otherwise the macros expand to nothing:
+ *      TRACE_SPAN(trace, "name");              opens a span closed at the end of the scope
+ *      TRACE_ARG(trace, "key", value);         attaches a numeric argument to the span
+ *      TRACE_SAVE("trace.json");               writes all spans recorded so far, once traced threads are done
+ */
+
+#ifdef MDP_TRACE
+
+#include <string>
+#include <utility>
+
+#define TRACE_MAX_ARGS 4
+
+using namespace std;
+
+class TraceSpan {
+    private:
+    const char *name;
+    double start;
+    pair<const char *, double> args[TRACE_MAX_ARGS];
+    int n_args;
+
+    public:
+    TraceSpan(const char *name);
+    ~TraceSpan();
+    void arg(const char *key, double value);
+};
+
+void trace_save(string path);
+
+#define TRACE_SPAN(trace, name) TraceSpan trace(name)
+#define TRACE_ARG(trace, key, value) trace.arg(key, value)
+#define TRACE_SAVE(path) trace_save(path)
+
+#else
+
+#define TRACE_SPAN(trace, name)
+#define TRACE_ARG(trace, key, value)
+#define TRACE_SAVE(path)
+
+#endif
+
+#endif
@@ -5,4 +5,11 @@
 #include "../src/mdp.hpp"
 %}
 
-%include "../src/mdp.hpp"
\ No newline at end of file
+%include "../src/mdp.hpp"
+
+%template(MDP) BasicMDP<float>;
+%template(OfflineMDP) BasicOfflineMDP<float>;
+%template(Agent) BasicAgent<float>;
+%template(DoubleMDP) BasicMDP<double>;
+%template(DoubleOfflineMDP) BasicOfflineMDP<double>;
+%template(DoubleAgent) BasicAgent<double>;
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <random>
+#include <numeric>
+#include "src/algorithms.hpp"
+
+#define EPS 1e-6
+#define RANDOM_MODELS 50
+#define VISITS_PER_PAIR 100000000
+
+using namespace std;
+
+static bool failed = false;
+
+void check(bool condition, const string &message) {
+    cout << (condition ? "ok     " : "FAILED ") << message << endl;
+    failed |= !condition;
+}
+
+void compare_value_iteration(OfflineMDP &mdp, const string &name, bool same_policy, long &total_skipped) {
+    /* Value iteration with and without elimination must agree on the gain, and on the policy when it is unique */
+    long skipped_backups;
+    auto plain = value_iteration(mdp, 1e6, EPS, false, skipped_backups);
+    auto eliminated = value_iteration(mdp, 1e6, EPS, true, skipped_backups);
+    total_skipped += skipped_backups;
+
+    check(abs(get<1>(plain) - get<1>(eliminated)) < EPS, name + ": gain " + to_string(get<1>(plain)) + " with elimination " + to_string(get<1>(eliminated)) + ", skipping " + to_string(skipped_backups) + " backups");
+    if (same_policy)
+        check(get<0>(plain).v == get<0>(eliminated).v, name + ": same policy with elimination");
+}
+
+void compare_extended_value_iteration(OfflineMDP &mdp, const string &name, long &total_skipped) {
+    /* Same as compare_value_iteration with EVI, on estimates from VISITS_PER_PAIR exact visits of every pair */
+    Workspace workspace(mdp);
+    StateActionIndex &pairs = mdp.getPairs();
+    vector<int> visits(pairs.size(), VISITS_PER_PAIR);
+    vector<float> observed_rewards(pairs.size());
+    vector<SparseVector<int>> observed_transitions(pairs.size());
+    for (int k=0; k<pairs.size(); k++) {
+        int x = pairs.states[k], a = pairs.actions[k];
+        observed_rewards[k] = mdp.getRewards(x, a) * VISITS_PER_PAIR;
+        for (int y=0; y<mdp.getStates(); y++)
+            if (int count = mdp.getTransitionChance(x, a, y) * VISITS_PER_PAIR)
+                observed_transitions[k].push_back({y, count});
+    }
+    workspace.extended_mdp.update(mdp, visits, observed_rewards, observed_transitions, 1000000, 0.05);
+
+    long skipped_backups;
+    double plain = extended_value_iteration(mdp, workspace.extended_mdp, 1e6, EPS, false, skipped_backups, workspace);
+    vector<int> plain_policy = workspace.best_action;
+    double eliminated = extended_value_iteration(mdp, workspace.extended_mdp, 1e6, EPS, true, skipped_backups, workspace);
+    total_skipped += skipped_backups;
+
+    check(abs(plain - eliminated) < EPS, name + ": gain " + to_string(plain) + " with elimination " + to_string(eliminated) + ", skipping " + to_string(skipped_backups) + " backups");
+    check(plain_policy == workspace.best_action, name + ": same policy with elimination");
+}
+
+int main() {
+    // Two states where the best action of state 0 only shows late: a1 looks better until the bias of state 1 builds up
+    Matrix<int> actions = {{0, 1}, {0, 1}};
+    Matrix3D<float> transitions = {
+        {{0.2f, 0.8f}, {1.0f, 0.0f}},
+        {{0.1f, 0.9f}, {0.1f, 0.9f}}
+    };
+    Matrix<float> rewards = {{0.0f, 0.3f}, {0.4f, 0.2f}};
+    OfflineMDP two_states(actions, transitions, rewards);
+    long skipped = 0;
+    compare_value_iteration(two_states, "two states", true, skipped);
+    check(skipped > 0, "two states: elimination skips backups");
+
+    // Coprime steps: every pair reaches every state with chance 0.01 at least, so elimination is enabled
+    // Value iteration converges in 2 sweeps there, before the bound rules out any pair, so only agreement is checked
+    const int states = 10;
+    Matrix<int> coprime_actions(states);
+    for (int x=0; x<states; x++)
+        for (int a=0; a<states; a++)
+            if (gcd(x+1, a+1) == 1)
+                coprime_actions[x].push_back(a);
+    Matrix3D<float> coprime_transitions(states, Matrix<float>(states));
+    Matrix<float> coprime_rewards(states, vector<float>(states));
+    for (int x=0; x<states; x++) {
+        for (int a: coprime_actions[x]) {
+            coprime_transitions[x][a].assign(states, 0.01f);
+            coprime_transitions[x][a][(x+a+1)%states] = 0.91f;
+            coprime_rewards[x][a] = (float) ((x+a+2)%states) / 10;
+        }
+    }
+    OfflineMDP coprime(coprime_actions, coprime_transitions, coprime_rewards);
+    compare_value_iteration(coprime, "coprime steps", true, skipped);
+
+    // Extended MDPs whose estimates are close to the kernel, so that every allowed transition keeps some chance of reaching state 0
+    skipped = 0;
+    compare_extended_value_iteration(two_states, "two states EVI", skipped);
+    check(skipped > 0, "two states EVI: elimination skips backups");
+    compare_extended_value_iteration(coprime, "coprime steps EVI", skipped);
+
+    // Random models with sparse rows, where every pair returns to state 0 with chance 0.05 at least
+    mt19937 gen(0);
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    skipped = 0;
+    for (int m=0; m<RANDOM_MODELS; m++) {
+        int n = 2 + gen() % 12;
+        int a_max = 1 + gen() % 4;
+        Matrix<int> random_actions(n);
+        Matrix3D<float> random_transitions(n, Matrix<float>(a_max, vector<float>(n, 0.0f)));
+        Matrix<float> random_rewards(n, vector<float>(a_max, 0.0f));
+        for (int x=0; x<n; x++) {
+            for (int a=0; a<a_max; a++) {
+                if (a > 0 && gen() % 3 == 0)
+                    continue;
+                random_actions[x].push_back(a);
+                vector<float> &row = random_transitions[x][a];
+                float total = 0.0f;
+                for (int y=0; y<n; y++) {
+                    if (gen() % 3 == 0) {
+                        row[y] = uniform(gen);
+                        total += row[y];
+                    }
+                }
+                for (int y=0; y<n; y++)
+                    row[y] = total > 0 ? 0.95f * row[y] / total : 0.0f;
+                row[0] += total > 0 ? 0.05f : 1.0f;
+                random_rewards[x][a] = uniform(gen);
+            }
+        }
+        OfflineMDP random_mdp(random_actions, random_transitions, random_rewards);
+        compare_value_iteration(random_mdp, "random model " + to_string(m), false, skipped);
+    }
+    check(skipped > 0, "random models: elimination skips backups");
+
+    cout << (failed ? "FAILED" : "OK") << endl;
+    return failed ? 1 : 0;
+}
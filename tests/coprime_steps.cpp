@@ -1,6 +1,6 @@
 #include <vector>
 #include <iostream>
-#include "src/mdp.hpp"
+#include "src/algorithms.hpp"
 
 using namespace std;
 
@@ -14,10 +14,11 @@ int main() {
         }
     }
 
-    Matrix3D<float> transitions(states, Matrix<float>(states, vector<float>()));
+    // Only legal pairs need a row in the kernel, rows of other pairs are left empty
+    Matrix3D<float> transitions(states, Matrix<float>(states));
     for (int x=0; x<10; x++) {
-        for (int a=0; a<10; a++) {
-            for (int y=0; y<10; y++) transitions[x][a][y] = 0.01f;
+        for (int a: actions[x]) {
+            transitions[x][a].assign(states, 0.01f);
             transitions[x][a][(x+a+1)%10] = 0.91f;
         }
     }
@@ -59,4 +60,19 @@ int main() {
 
         cout << "=============================================" << endl;
     }
+
+    // Solve the model with and without action elimination
+    OfflineMDP offline_mdp(actions, transitions, rewards);
+    auto vi_output = value_iteration(offline_mdp, 1e5, 1e-5);
+    long skipped_backups;
+    auto ae_output = value_iteration(offline_mdp, 1e5, 1e-5, true, skipped_backups);
+    cout << "Gain with value iteration is " << get<1>(vi_output) << endl;
+    cout << "Gain with action elimination is " << get<1>(ae_output) << ", skipping " << skipped_backups << " backups" << endl;
+    show_policy(get<0>(vi_output));
+    show_policy(get<0>(ae_output));
+
+    // Learner counts and estimates only hold legal pairs
+    cout << "Learning on " << offline_mdp.getPairs().size() << " legal pairs out of " << states * offline_mdp.getMaxAction() << endl;
+    auto ucrl2_output = ucrl2(offline_mdp, 1e-5, 10000);
+    cout << endl << "UCRL2 ran " << get<1>(ucrl2_output).size() << " episodes" << endl;
 }
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include "src/algorithms.hpp"
+#include "src/mdp/riverswim.cpp"
+
+#define N 8
+#define PAST_STEPS 2000
+#define DURATION 600
+#define THREADS 4
+
+using namespace std;
+
+static bool failed = false;
+
+void check(bool condition, const string &message) {
+    cout << (condition ? "ok     " : "FAILED ") << message << endl;
+    failed |= !condition;
+}
+
+bool throws_invalid_argument(function<void()> f) {
+    try {
+        f();
+    } catch (invalid_argument &) {
+        return true;
+    }
+    return false;
+}
+
+int main() {
+    auto mdp_info = Riverswim(N, 0.35, 0.05, 0.1, 0.9);
+    auto actions = get<0>(mdp_info);
+    auto transitions = get<1>(mdp_info);
+    auto rewards = get<2>(mdp_info);
+    OfflineMDP mdp(actions, transitions, rewards);
+
+    // Record a history with a fixed seed, mostly swimming right
+    mt19937 gen(42);
+    uniform_real_distribution<> uniform(0, 1);
+    History recorded;
+    int x = 0;
+    for (int i=0; i<PAST_STEPS+DURATION; i++) {
+        int a = uniform(gen) < 0.7;
+        discrete_distribution<> successor(transitions[x][a].begin(), transitions[x][a].end());
+        int y = successor(gen);
+        recorded.push_back(Event(x, a, y, uniform(gen) < rewards[x][a]));
+        x = y;
+    }
+    History past(recorded.begin(), recorded.begin() + PAST_STEPS);
+    History history(recorded.begin() + PAST_STEPS, recorded.end());
+
+    // Blocks solved on several threads must give exactly the gains of a single thread
+    Policy policy = {{vector<int>(N, 1)}};
+    auto serial = performance_test(mdp, policy, past, history, PAST_STEPS, DURATION, 1e-5, 1);
+    auto parallel = performance_test(mdp, policy, past, history, PAST_STEPS, DURATION, 1e-5, THREADS);
+    check(serial.first == parallel.first, "gains of the policy are identical with " + to_string(THREADS) + " threads");
+    check(serial.second == parallel.second, "optimistic gains are identical with " + to_string(THREADS) + " threads");
+
+    // Errors reach the caller as exceptions whatever the number of threads
+    Policy illegal = {{vector<int>(N, 2)}};
+    check(throws_invalid_argument([&]() {performance_test(mdp, illegal, past, history, PAST_STEPS, DURATION, 1e-5, THREADS);}), "illegal policy throws invalid_argument");
+    History corrupted = history;
+    corrupted[DURATION/2] = Event(0, 2, 0, 0.0);
+    check(throws_invalid_argument([&]() {performance_test(mdp, policy, past, corrupted, PAST_STEPS, DURATION, 1e-5, THREADS);}), "illegal action in history throws invalid_argument");
+
+    cout << (failed ? "FAILED" : "OK") << endl;
+    return failed ? 1 : 0;
+}
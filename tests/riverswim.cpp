@@ -3,6 +3,8 @@
 #include <random>
 #include "src/algorithms.hpp"
 #include "src/io.hpp"
+#include "src/series.hpp"
+#include "src/trace.hpp"
 #include "src/mdp/riverswim.cpp"
 #include "include/matplotlib-cpp/matplotlibcpp.h"
 
@@ -27,7 +29,39 @@ int main() {
     Policy policy = get<0>(vi_output);
     double opt_rewards = get<1>(vi_output);
     show_policy(policy);
-    cout << "Gain is " << opt_rewards << endl << endl;
+    cout << "Gain is " << opt_rewards << endl;
+
+    // Same with Anderson acceleration, comparing the cost of both runs
+    long skipped_backups;
+    SolverDiagnostics plain_run, accelerated_run;
+    value_iteration(mdp, 1e5, 1e-5, false, skipped_backups, false, &plain_run);
+    auto accelerated_output = value_iteration(mdp, 1e5, 1e-5, false, skipped_backups, true, &accelerated_run);
+    cout << "Gain with acceleration is " << get<1>(accelerated_output) << " after " << accelerated_run.sweeps << " sweeps instead of " << plain_run.sweeps << endl << endl;
+
+    // Compare with policy iteration and modified policy iteration
+    cout << "--- Policy iteration" << endl;
+    auto pi_output = policy_iteration(mdp, 1e3);
+    show_policy(get<0>(pi_output));
+    cout << "Gain is " << get<1>(pi_output) << endl;
+    auto mpi_output = modified_policy_iteration(mdp, 20, 1e5, 1e-5);
+    cout << "Gain with modified policy iteration is " << get<1>(mpi_output) << endl << endl;
+
+    // Solve the same model with transitions generated on demand
+    cout << "--- Implicit model" << endl;
+    ImplicitMDP implicit_mdp = ImplicitRiverswim(N, 0.35, 0.05, 0.1, 0.9);
+    auto implicit_vi_output = value_iteration(implicit_mdp, 1e5, 1e-5);
+    cout << "Gain is " << get<1>(implicit_vi_output) << endl;
+    BasicImplicitMDP<double> double_mdp = ImplicitRiverswim<double>(N, 0.35, 0.05, 0.1, 0.9);
+    cout << "Gain with double precision chances is " << get<1>(value_iteration(double_mdp, 1e5, 1e-5)) << endl << endl;
+
+    // Solve and simulate the same model with sizes fixed at compile time
+    cout << "--- Fixed-size model" << endl;
+    constexpr FixedMDP<N, 2> fixed_mdp = FixedRiverswim<N>(0.35, 0.05, 0.1, 0.9);
+    FixedPolicy<N> fixed_policy;
+    array<double, N> fixed_bias;
+    cout << "Gain is " << fixed_value_iteration(fixed_mdp, 1e5, 1e-5, fixed_policy, fixed_bias) << endl;
+    FixedSimulator<N, 2> fixed_simulator(fixed_mdp);
+    cout << "Average rewards over " << SIM_STEPS << " steps are " << fixed_simulator.rollout(fixed_policy, SIM_STEPS) / SIM_STEPS << endl << endl;
 
     // Apply policy and estimate invariant measure
     cout << "--- Invariant measure" << endl;
@@ -38,6 +72,16 @@ int main() {
         cout << setw(12) << f << " ";
     cout << endl << endl;
 
+    // Estimate it again with parallel chains, until confidence intervals are narrow enough
+    InvariantMeasureEstimate estimate = invariant_measure_estimate(mdp, policy, SIM_STEPS, 1e4, 1e-3);
+    cout << "Invariant measure after " << estimate.steps << " steps on parallel chains is estimated to be:" << endl;
+    for (int x=0; x<N; x++)
+        cout << setw(12) << estimate.measure[x] << " ";
+    cout << endl;
+    for (int x=0; x<N; x++)
+        cout << setw(10) << "+/-" << setw(8) << estimate.half_width[x] << " ";
+    cout << endl << endl;
+
     // Get invariant measure from value iteration
     vector<float> im = invariant_measure(mdp, policy);
     cout << "Invariant measure with value iteration is supposed to be:" << endl;
@@ -49,10 +93,45 @@ int main() {
     cout << "--- UCRL2" << endl;
     MDP rl_mdp = (MDP) mdp;
     int duration = SIM_STEPS_UCRL;
-    auto ucrl_output = ucrl2(rl_mdp, 1e-5, duration);
+    Workspace ucrl_workspace(rl_mdp);
+    auto ucrl_output = ucrl2(rl_mdp, 1e-5, duration, 0, History(0), ucrl_workspace);
     History history = ucrl_output.first;
     EpisodeHistory episode_history = ucrl_output.second;
 
+    // Report planning cost and episodes whose extended value iteration did not converge
+    long evi_sweeps = 0;
+    int unconverged_episodes = 0;
+    for (SolverDiagnostics &run: episode_history.diagnostics) {
+        evi_sweeps += run.sweeps;
+        unconverged_episodes += run.hit_cap;
+    }
+    cout << episode_history.size() << " episodes planned in " << evi_sweeps << " EVI sweeps, " << unconverged_episodes << " without converging" << endl;
+
+    // Plan on the counts of the last episode with both extended MDPs, the fixed-size one holding them in [x][a] tables
+    StateActionIndex &pairs = rl_mdp.getPairs();
+    FixedTable<int, N, 2> fixed_visits{};
+    FixedTable<float, N, 2> fixed_observed_rewards{};
+    FixedKernel<int, N, 2> fixed_observed_transitions{};
+    for (int x=0; x<N; x++) {
+        for (int a: rl_mdp.getAvailableActions(x)) {
+            int k = pairs.find(x, a);
+            fixed_visits[x][a] = ucrl_workspace.visits_before_episode[k];
+            fixed_observed_rewards[x][a] = ucrl_workspace.observed_rewards_before_episode[k];
+            for (auto [y, count]: ucrl_workspace.observed_transitions_before_episode[k])
+                fixed_observed_transitions[x][a][y] = count;
+        }
+    }
+    FixedExtendedMDP<N, 2> fixed_extended_mdp;
+    fixed_extended_mdp.update(fixed_visits, fixed_observed_rewards, fixed_observed_transitions, duration, 1e-5);
+    FixedPolicy<N> optimistic_policy;
+    array<double, N> optimistic_bias;
+    double fixed_optimistic_gain = fixed_extended_value_iteration(fixed_extended_mdp, 1e3, 1e-5, optimistic_policy, optimistic_bias);
+
+    ExtendedMDP &extended_mdp = ucrl_workspace.extended_mdp;
+    extended_mdp.update(rl_mdp, ucrl_workspace.visits_before_episode, ucrl_workspace.observed_rewards_before_episode, ucrl_workspace.observed_transitions_before_episode, duration, 1e-5);
+    double optimistic_gain = extended_value_iteration(rl_mdp, extended_mdp, 1e3, 1e-5, false, skipped_backups, ucrl_workspace);
+    cout << "Optimistic gain of the last episode is " << optimistic_gain << ", " << fixed_optimistic_gain << " with the fixed-size model (difference " << abs(optimistic_gain - fixed_optimistic_gain) << ")" << endl;
+
     // Compute gap regrets
     double total_rl_rewards=0, total_gap_regret=0;
     Matrix<double> gap_regret_matrix(N, vector<double>(2));
@@ -61,8 +140,8 @@ int main() {
             gap_regret_matrix[x][a] = gap_regret(x, a, mdp);
     
     // Plot empirical regrets and gap regrets
-    vector<double> regrets;
-    vector<double> gap_regrets;
+    Series regrets;
+    Series gap_regrets;
     
     int i=0;
     for (Event event: history) {
@@ -72,18 +151,20 @@ int main() {
         double reward = get<3>(event);
         total_rl_rewards += reward;
         double regret = i*opt_rewards - total_rl_rewards;
-        regrets.push_back(regret);
+        regrets.push(regret);
 
         int x=get<0>(event), a=get<1>(event);
         total_gap_regret += gap_regret_matrix[x][a];
-        gap_regrets.push_back(total_gap_regret);
+        gap_regrets.push(total_gap_regret);
     }
 
     cout << "Waiting for matplotlib..." << endl;
     plt::figure();
-    plt::plot(regrets);
-    plt::plot(gap_regrets);
+    plt::plot(regrets.getX(), regrets.getMeans());
+    plt::plot(gap_regrets.getX(), gap_regrets.getMeans());
     plt::save("ucrl2_regret.pdf");
+    regrets.save("ucrl2_regret.csv");
+    gap_regrets.save("ucrl2_gap_regret.csv");
 
     cout << endl;
 
@@ -93,34 +174,31 @@ int main() {
     int bad_episode_start = episode_history[k].first;
     int bad_episode_duration = episode_history[k+1].first - bad_episode_start;
     cout << "Episode starts at step " << bad_episode_start << " and lasted " << bad_episode_duration << " steps" << endl;
-    Policy bad_policy = episode_history[k].second;
+    Policy bad_policy = episode_history.getPolicy(k);
     
     History past(history.begin(), history.begin() + bad_episode_start);
-    vector<pair<vector<double>, vector<double>>> performance_test_outputs;
+    Series g;
+    Series g_opt;
     for (int i=0; i<25; i++) {
         show_loading_bar("Performance test... ", i+1, 25);
         auto bad_episode_playback = ucrl2(mdp, 1e-5, 0, 1, past);
-        auto performance_test_output = performance_test(mdp, bad_policy, past, get<0>(bad_episode_playback), bad_episode_start, 1000, 1e-5);
-        performance_test_outputs.push_back(performance_test_output);
-    }
+        auto performance_test_output = performance_test(mdp, bad_policy, past, get<0>(bad_episode_playback), bad_episode_start, 1000, 1e-5, 0);
 
-    vector<double> g;
-    vector<double> g_opt;
-    for (int i=0; i<1000; i++) {
-        double gi = 0.0;
-        double gi_opt = 0.0;
-        for (auto a: performance_test_outputs) {
-            gi += a.first[i];
-            gi_opt += a.second[i];
-        }
-        g.push_back(gi/25);
-        g_opt.push_back(gi_opt/25);
+        // Average gains over runs by merging their series
+        Series gi, gi_opt;
+        for (double gain: performance_test_output.first)
+            gi.push(gain);
+        for (double gain: performance_test_output.second)
+            gi_opt.push(gain);
+        g.merge(gi);
+        g_opt.merge(gi_opt);
     }
 
     plt::figure();
-    plt::plot(g_opt);
-    plt::plot(g);
+    plt::plot(g_opt.getX(), g_opt.getMeans());
+    plt::plot(g.getX(), g.getMeans());
     plt::save("performance_test.pdf");
 
+    TRACE_SAVE("riverswim_trace.json");
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <cstdlib>
+#include <new>
+#include "src/algorithms.hpp"
+#include "src/mdp/riverswim.cpp"
+
+#define N 8
+
+using namespace std;
+
+// Count every heap allocation of the program
+static long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    if (void *p = malloc(size))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+int main() {
+    auto mdp_info = Riverswim(N, 0.35, 0.05, 0.1, 0.9);
+    auto actions = get<0>(mdp_info);
+    auto transitions = get<1>(mdp_info);
+    auto rewards = get<2>(mdp_info);
+    OfflineMDP mdp(actions, transitions, rewards);
+
+    Workspace workspace(mdp);
+    long skipped_backups;
+
+    // Estimates of an extended MDP from a short UCRL2 run
+    ucrl2(mdp, 1e-5, 0, 20, History(0), workspace);
+    ExtendedMDP &extended_mdp = workspace.extended_mdp;
+    extended_mdp.update(mdp, workspace.visits_before_episode, workspace.observed_rewards_before_episode, workspace.observed_transitions_before_episode, 1000, 1e-5);
+
+    // Warm up: buffers reach their steady-state capacity
+    Policy policy = {{vector<int>(N, 1)}};
+    Agent agent(mdp, policy);
+    for (int i=0; i<1000; i++)
+        agent.usePolicy();
+    value_iteration(mdp, 1e5, 1e-5, true, skipped_backups, workspace);
+    extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5, true, skipped_backups, workspace);
+    value_iteration(mdp, 1e5, 1e-5, true, skipped_backups, workspace, true);
+    extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5, true, skipped_backups, workspace, true);
+
+    // Steady state: simulation and planning must not allocate
+    allocations = 0;
+    for (int i=0; i<100000; i++)
+        agent.usePolicy();
+    long simulation_allocations = allocations;
+
+    allocations = 0;
+    double g = value_iteration(mdp, 1e5, 1e-5, true, skipped_backups, workspace);
+    long vi_allocations = allocations;
+
+    allocations = 0;
+    double g_opt = extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5, true, skipped_backups, workspace);
+    long evi_allocations = allocations;
+
+    allocations = 0;
+    value_iteration(mdp, 1e5, 1e-5, true, skipped_backups, workspace, true);
+    extended_value_iteration(mdp, extended_mdp, 1e3, 1e-5, true, skipped_backups, workspace, true);
+    long accelerated_allocations = allocations;
+
+    cout << "Allocations during 100000 simulation steps: " << simulation_allocations << endl;
+    cout << "Allocations during value iteration (gain " << g << "): " << vi_allocations << endl;
+    cout << "Allocations during extended value iteration (gain " << g_opt << "): " << evi_allocations << endl;
+    cout << "Allocations during accelerated value iterations: " << accelerated_allocations << endl;
+
+    if (simulation_allocations || vi_allocations || evi_allocations || accelerated_allocations) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}